@@ -24,23 +24,98 @@
 //         feedback and conversion to RPM.
 // Note 8: Added code to test conversion of bits on DAC
 // Note 9: Added extra write to DAC as sometimes it didnt work ?
+// Note 10: Added gain schedule table (Kp, Ki, Kd against MPa) saved
+//         to EEPROM after the setup and interpolated every cycle.
+// Note 11: RSP now ramps to TSP at the set rate using a 1ms Timer2
+//         tick, with optional feed-forward from the ramp slope and
+//         a static plant gain. Setup is saved byte for byte as the
+//         string routines stopped at the first zero byte.
+// Note 12: ADC is now read in the Timer2 ISR while the loop runs and
+//         checked there for over pressure, saturation, stuck value,
+//         encoder stall and loop overrun. A trip writes the safe DAC
+//         output at once and latches the cause, which survives a WDT
+//         restart. Calibration is now kept in EEPROM (menu option 4).
+// Note 13: Loop output is now a 16 bit command (12 bit DAC + 4 bits)
+//         dithered onto the AD7243 every 1ms tick by error feedback.
+//         DAC is written once per update, replacing the double write
+//         of note 9. With DAC_READBACK (SDO wired to DI) each write
+//         shifts back the code loaded by the one before, which is
+//         checked against what was sent - a mismatch is counted and
+//         the code written again. The count is input register 0x300
+//         and shown in the menu.
+// Note 14: Encoder speed is now M/T - edges counted over a 20ms gate
+//         (CCP2 capturing every 16th edge) at high speed and Timer1
+//         period between edges at low speed, switching with
+//         hysteresis. get_motor_rpm() no longer blocks for 50ms.
+//         Timer1 wraps every 104.9ms, so after ENC_TIMEOUT_MS with no
+//         edge the period is dropped and the next edge starts again.
+// Note 15: Modbus RTU slave on USB1 (RX on RB0/INT0). Registers read
+//         and write the live trx, gs, cal, fault and loop structures
+//         directly. Loop variables moved into struct LOOP for this.
+//         INT0 only catches the start bit, Timer3 (high priority)
+//         samples each bit at its centre, so a character never holds
+//         up the 1ms tick. The fault map is read via fault_snapshot().
+//         Console input and the long waits outside run_pid() poll the
+//         slave too (con_getc(), wait_ms()), and a frame older than
+//         MB_STALE_MS is dropped rather than answered after the
+//         master has given up on it. Holding register writes are
+//         range checked (exception 3 and nothing changed if not),
+//         saved to EEPROM and re-run the estimator / Smith setup.
+// Note 16: run_pid() is now a small cooperative kernel - control,
+//         acquisition, telemetry, console, Modbus and NVM are separate
+//         stackless tasks. A task only gets a slice if its budget fits
+//         before the next ADC sample so control always keeps its
+//         period. 'T' in the loop shows per task CPU use and misses.
+// Note 17: D now comes from a fixed point alpha-beta estimator (steady
+//         state Kalman gains) run on every ADC sample - D = -rate in
+//         MPa per sample, the same units as the old 5 sample window.
+//         Process and measurement noise are in the setup (menu E),
+//         either set to 0 gives the old windowed D.
+// Note 18: Optional Smith predictor (menu S) - a first order plus dead
+//         time model of the cell is stepped in fixed point on each
+//         sample and the model's own delayed/undelayed difference is
+//         added to MV, so the PID acts on the pressure to come.
+// Note 19: PRBS excitation (menu X) - the DAC steps between bias +/-
+//         amplitude on a 9 bit maximal length sequence while every ADC
+//         sample is logged as PRBS,n,DAC,ADC for host/sysid. The ISR
+//         interlock stays on, Esc or a trip ends the test.
+// Note 20: Multi-byte data written in the ISRs (encoder gate/period,
+//         ADC sample and tick, fault record) is read through
+//         sequence counters - each ISR bumps its counter after an
+//         update and the reader copies again if it moved. Neither
+//         side ever masks or waits for the other, so an 8 bit PIC can
+//         no longer return half of an old and half of a new value.
+// Note 21: Named recipes (menu R) - up to 6 setups in an EEPROM
+//         directory from 0x100. 'R' and a slot number in the running
+//         loop switch recipe between control passes without restarting
+//         the ADC. The first pass on the new recipe takes the output
+//         difference as an offset, which decays with RECIPE_BUMP_MS, so
+//         the output moves to the new law's value smoothly whatever
+//         changed (gains, band, ff, estimator or Smith model).
+//         With the gain table on (menu G) it sets Kp/Ki/Kd, the recipe
+//         gains are only used when it is off.
 //*******************************************************************
 #include   <18F4620.h>
 #device    PASS_STRINGS=IN_RAM
+#device    HIGH_INTS=TRUE              // Modbus bit sampling, note 15
 #device     *= 16;
 #fuses     HS, WDT, WDT256, NOPROTECT, BROWNOUT, PUT, NOLVP, NODEBUG, MCLR
 #use       DELAY(CLOCK=20MHz, RESTART_WDT)
            // Modified so it restarts WDT./
 #use       RS232(BAUD=115200, XMIT=PIN_C6, RCV=PIN_C7, ERRORS, STREAM=USB,
            RESTART_WDT, BITS=8, PARITY=N, STOP=1)
-#use       R232(BAUD=19200 , XMIT=PIN_C0, ERRORS, STREAM=USB1, RESTART_WDT,
-           BITS=8, PARITY=N, STOP=1)
+#use       RS232(BAUD=19200 , XMIT=PIN_C0, RCV=PIN_B0, ERRORS, STREAM=USB1,
+           RESTART_WDT, DISABLE_INTS, BITS=8, PARITY=N, STOP=1)
+           // Software UART - DISABLE_INTS delays the tick by at most one
+           // character (520us) while sending, it never loses one. RX
+           // is not read with fgetc(), see modbus_rx_isr().
 #use       SPI(MASTER, DO=PIN_C5, DI=PIN_C4, CLK=PIN_C3, MSB_FIRST, MODE=0,
            BITS=16, STREAM=SPI)
 
 #include <string.h> 
 #include <stdlib.h> 
 #include <float.h>
+#include <math.h>
 
 #define    VERBOSE          1
 #define    SILENT           0
@@ -48,6 +123,94 @@
 #define    NO_ERASE         0
 #define    SETUP_PRESENT    0x62
 #define    FIFO_SIZE        12
+#define    LOG_EVERY        20       // Passes per record (1 for log_replay)
+
+// Gain schedule table - breakpoints spread evenly from 0 to MAX_MPA
+#define    GS_POINTS        9
+#define    GS_SHIFT         10       // Gains held as Q6.10 (0 to 63.99)
+#define    GS_PRESENT       0x47
+#define    GS_EEPROM_ADDR   0x80     // Setup (trx) lives below this
+
+#define    MS_PER_MIN       60000.0
+
+#define    CAL_PRESENT      0x43
+#define    CAL_EEPROM_ADDR  0xC0
+#define    FAULT_EEPROM_ADDR 0xE0
+
+// Recipe directory - slot n at RECIPE_EEPROM_ADDR + n * RECIPE_SIZE holds
+// RECIPE_PRESENT, the name, a check byte and then an image of trx
+#define    RECIPE_EEPROM_ADDR 0x100
+#define    RECIPE_SLOTS     6        // To the end of the 1K data EEPROM
+#define    RECIPE_SIZE      0x80     // trx must fit in this less the header
+#define    RECIPE_NAME      10       // Including the NUL
+#define    RECIPE_HDR       (RECIPE_NAME + 2)
+#define    RECIPE_PRESENT   0x52
+#define    RECIPE_BUMP_MS   2000     // Switch offset decay time constant
+
+// Latched fault causes
+#define    FAULT_NONE       0
+#define    FAULT_OVER_MPA   1        // ADC above cal.TRIP_BITS
+#define    FAULT_UNDER_MPA  2        // ADC well below 0 MPa (open sensor)
+#define    FAULT_ADC_SAT    3        // AD7705 saturation code
+#define    FAULT_ADC_STUCK  4        // Same reading while driving the valve
+#define    FAULT_ENC_STALL  5        // Driving but no encoder edges
+#define    FAULT_OVERRUN    6        // Loop not taking ADC samples
+#define    FAULT_ADC_TIMEOUT 7       // No DRDY from the AD7705
+#define    FAULT_MAGIC      0xA5
+
+#define    ADC_SATURATED    0xfff0   // As exercise_adc()
+#define    STUCK_SAMPLES    50       // 1 second at 50Hz
+#define    OVERRUN_LIMIT    10       // Samples missed in a row
+#define    ADC_TIMEOUT_MS   100      // Five missed conversions at 50Hz
+#define    DAC_MID          0x800    // 0V on the AD7243
+#define    PRBS_LENGTH      511      // 9 bit LFSR, x^9 + x^5 + 1
+#define    DAC_DRIVE        0x199    // 1V, below this no motion expected
+#define    DAC16_MAX        0xfff0   // 16 bit command, 12 bit DAC << 4
+#define    DAC_READBACK     0        // 1 only if AD7243 SDO is wired to SPI DI
+
+// Encoder speed measurement (M/T)
+#define    SF               1024     // There are 1024 pulses / rev
+#define    T1_HZ            625000   // Timer1 = 20MHz/4/8, 1.6us
+#define    ENC_GATE_MS      20       // Counting gate
+#define    ENC_DIV          16       // Edges per capture when counting
+#define    ENC_T_TO_M       200      // Period below 320us (3.1KHz) - count
+#define    ENC_M_TO_T       30       // Under 30 edges/gate (1.5KHz) - time
+#define    ENC_TIMEOUT_MS   100      // No edges for this long is 0 RPM,
+                                     // under the 104.9ms Timer1 wrap
+
+// Modbus RTU slave on USB1
+#define    MB_ADDRESS       1
+#define    MB_MAX_REGS      32       // Per read, keeps a reply under 40ms
+#define    MB_BUF_SIZE      (9 + 2 * MB_MAX_REGS)  // FC16 of MB_MAX_REGS
+#define    MB_GAP_MS        3        // 3.5 characters at 19200 is 1.8ms
+#define    MB_MAPS          6
+#define    MB_HOLDING       0        // FC 03, 06, 16 - read/write
+#define    MB_INPUT         1        // FC 04 - read only
+#define    MB_LOOP_REGS     10       // Per read while the loop runs (13ms)
+#define    MB_BIT_T3        260      // Timer3 ticks (200ns) per bit at 19200
+#define    MB_STALE_MS      150      // Master gives up at 200ms
+
+// Cooperative tasks in run_pid() - highest priority first
+#define    TASK_CONTROL     0        // Each ADC sample
+#define    TASK_ACQ         1        // Encoder speed
+#define    TASK_TELEMETRY   2        // Log records to the console
+#define    TASK_CONSOLE     3        // Operator keys
+#define    TASK_MODBUS      4        // One request per slice
+#define    TASK_PERSIST     5        // EEPROM, one byte per slice
+#define    TASKS            6
+#define    CONTROL_MS       20       // AD7705 output rate until measured
+#define    T1_PER_MS        625      // Timer1 counts per ms
+#define    CPU_WINDOW_MS    1000
+#define    CPU_PERCENT      6250     // Timer1 counts in 1% of the window
+#define    TX_BUF_SIZE      80
+#define    SMITH_RING       64       // Dead time up to 1.26s at 50Hz
+
+// Stackless tasks - a task returns to yield and carries on from the
+// saved line next time it runs. Locals do not survive a yield.
+#define    PT_BEGIN(t)      switch(task[t].lc) { case 0:
+#define    PT_YIELD(t)      task[t].lc = __LINE__; return; case __LINE__:
+#define    PT_WAIT(t, c)    task[t].lc = __LINE__; case __LINE__: if (!(c)) return;
+#define    PT_END(t)        } task[t].lc = 0;
 
 #define    LED_STATUS PIN_D0
 #define    ADC_RESET  PIN_D1
@@ -113,6 +276,29 @@ void load_setup_from_nvm(void);
 void init_setup_defaults(void); 
 void save_setup_to_nvm(void);
 void get_restart_cause(void); 
+void check_fault_latch(void);
+void show_fault(void);
+void clear_fault(void);
+void fault_latch(UINT8, UINT16);
+UINT8 fault_check(void);
+void fault_save(void);
+void set_dac_output(UINT16);
+void dac_transfer(UINT16);
+UINT16 get_dac_errors(void);
+void modbus_init(void);
+void modbus_poll(void);
+void modbus_send(UINT8);
+void modbus_exception(UINT8);
+BOOL setup_valid(void);
+BOOL gains_valid(void);
+void modbus_setup_changed(void);
+UINT16 modbus_crc(UINT16, UINT8);
+void task_line(UINT8);
+UINT16 get_dac_bits16(float);
+void init_cal_defaults(void);
+void load_cal_from_nvm(void);
+void save_cal_to_nvm(void);
+void set_gain_scale(void);
 void clear_structure(void); 
 UINT16 read_zero_scale(int1);
 
@@ -125,6 +311,22 @@ void show_values(void);
 void erase_nvm(int16);
 void save_setup_to_nvm(int8); 
 void menu(void);
+void gain_schedule_menu(void);
+void load_gains_from_nvm(void);
+void save_gains_to_nvm(void);
+void init_gain_schedule(void);
+void get_scheduled_gains(UINT16, float *, float *, float *);
+void feed_forward_menu(void);
+void estimator_menu(void);
+void smith_menu(void);
+void prbs_test(void);
+BOOL recipe_load(UINT8, char *);
+void recipe_save(UINT8, char *);
+void recipe_apply(void);
+void recipe_switch(void);
+void recipe_menu(void);
+void init_tick(void);
+UINT32 get_ticks(void);
 
 float get_dac_volts(float mv, float sp, float pb); 
 float get_mpa(int16);
@@ -136,6 +338,8 @@ char g_istream[FIFO_SIZE];
 
 void run_pid(void);
 char timed_getc(long);
+char con_getc(void);
+void wait_ms(UINT16);
 long int read_adc_value(int1); 
 long int read_adc_word(void);
 
@@ -150,16 +354,57 @@ UINT16 get_valid_adc_data(int1);
 UINT16 get_dac_bits(float);
 UINT16 s_size;
 
-unsigned long rise; 
-unsigned long fall; 
-unsigned long pulse_width;
+UINT16 g_enc_idle;              // ms since the last encoder edge
+UINT16 g_enc_last;              // Timer1 at the last capture
+UINT16 g_enc_period;            // Timing - Timer1 counts between edges
+UINT16 g_enc_edges;             // Running edge count (wraps)
+BOOL   g_enc_count;             // Counting, CCP2 captures every 16th edge
+BOOL   g_enc_first;             // Next capture only starts the timing
+BOOL   g_enc_on;
+UINT16 g_gate_edges;            // Counting - edges in the last gate
+UINT16 g_gate_time;             // Counting - Timer1 counts across them
+UINT16 g_gate_e0, g_gate_t0;    // Edges and capture time at gate start
+UINT8  g_gate_ms;
+UINT8  g_enc_seq;               // Bumped by both ISRs after an update
+
+struct ENC_SNAP
+{    UINT16 idle, period, edges, time;
+     BOOL   count;
+};
 
+//***************************************************************************
+//     DESCRIPTION:        Encoder capture
+//     RETURN:             None
+//     NOTES:              Fixed cost, no division. Below 3.1KHz every edge
+//                         is captured and timed, above it the CCP prescaler
+//                         hands over every 16th edge so the interrupt rate
+//                         stays bounded whatever the speed.
+//***************************************************************************/
 #INT_CCP2 
 void isr()
-{    rise =     CCP_1;
-     fall =     CCP_2;
-     
-     pulse_width = fall - rise;
+{    UINT16 t;
+
+     t = CCP_2;
+     g_enc_idle = 0;
+     if (g_enc_first)
+            {   g_enc_first = FALSE;   // Edges before this are unknown
+                g_gate_e0 = g_enc_edges;
+                g_gate_t0 = t;
+            }
+     else if (g_enc_count)
+            g_enc_edges += ENC_DIV;
+     else   {   g_enc_edges++;
+                g_enc_period = t - g_enc_last;
+                if (g_enc_period < ENC_T_TO_M)
+                       {    setup_ccp2(CCP_OFF);   // Or the mode change can capture
+                            setup_ccp2(CCP_CAPTURE_DIV_16);
+                            g_enc_count = TRUE;
+                            g_enc_first = TRUE;
+                            g_gate_ms   = 0;   // Gate opens at the first capture
+                       }
+            }
+     g_enc_last = t;
+     g_enc_seq++;
 }
 
 // int16   write_motor(float);
@@ -190,8 +435,20 @@ struct SENSOR
      int16 HV_BITS;        // This is the max ADC value at HV_MPa 
      float MAX_MPA ;
      float coefs[3];       // Calibration / linearization coefficients
+     int16 TRIP_BITS;      // ADC value above which the loop trips
+     int16 SAFE_DAC ;      // DAC code written when the loop trips
+     int16 STALL_MS ;      // Encoder stall time when driving (0 = Off)
+     BOOL setup_ok  ;      // This value should be 0x43
 }    cal ;
 
+struct FAULT
+{    UINT8  magic     ;    // 0xA5 when record is valid
+     UINT8  cause     ;    // FAULT_xxx, zero when clear
+     UINT32 ticks     ;    // g_ticks when the fault latched
+     UINT16 adc       ;    // ADC reading at the time
+     UINT8  check     ;    // See fault_check()
+}    fault ;               // Not initialised so it survives a WDT reset
+
 struct PID
 {    char ident[sizeof(DEFAULT_STRING)]    ;
      float Kp, Ki, Kd ;    // Proportional, Integral and Derivative Gain
@@ -201,6 +458,14 @@ struct PID
      float mv         ;    // On startup this will be read as zero
      float pb         ;    // Proportional band in KPa.
      float mverr      ;    // MV Error signal value - not stored.
+     float ff_kv      ;    // Feed-forward volts per MPa/min of RSP slope
+     float ff_kpl     ;    // Static plant gain in MPa/V (0 = not used)
+     BOOL ff_on       ;    // Feed-forward used with this setup
+     float est_q      ;    // Estimator process noise MPa/s^2 (0 = off)
+     float est_r      ;    // Estimator measurement noise MPa (0 = off)
+     float sp_km      ;    // Smith model gain MPa/V (0 = off)
+     float sp_tau     ;    // Smith model time constant in s
+     float sp_dead    ;    // Smith model dead time in ms
      BOOL fwd[4]      ;    // Is loop forward or reverse PID
      BOOL setup_ok    ;    // This value should be 0x62
 
@@ -210,50 +475,324 @@ struct PID
 
 char buffer[sizeof(trx)];
 
+struct GAINS
+{    UINT16 Kp[GS_POINTS]  ;    // Gains at each breakpoint in Q6.10
+     UINT16 Ki[GS_POINTS]  ;
+     UINT16 Kd[GS_POINTS]  ;
+     BOOL enabled          ;    // Use table, otherwise trx.Kp, Ki, Kd
+     BOOL setup_ok         ;    // This value should be 0x47
+}    gs ;
+
+UINT32 gs_scale;                // ADC offset to breakpoint (Q8 result)
+
+struct LOOP
+{    float  mv         ;    // Measured value in MPa
+     float  P, I, D    ;    // Loop terms as printed
+     float  volts      ;    // Output before DAC conversion
+     float  ff         ;    // Feed-forward part of volts
+     float  Kp, Ki, Kd ;    // Gains in use (after gain schedule)
+     float  rpm        ;    // Motor speed at the last telemetry line
+     UINT16 adc        ;    // ADC reading used this pass
+     UINT16 lc         ;    // Pass count
+     float  mvf        ;    // Estimated (filtered) MV in MPa
+     float  rate       ;    // Estimated MV rate in MPa per sample
+     float  smith      ;    // Smith predictor correction added to MV
+}    loop ;
+
+struct MB_MAP
+{    UINT8  table      ;    // MB_HOLDING or MB_INPUT
+     UINT16 base       ;    // First register
+     UINT8  words      ;    // Registers (2 bytes each, in memory order)
+     int8   *data      ;    // Live structure
+};
+
+struct MB_MAP mb_map[MB_MAPS];
+UINT8  mb_buf[MB_BUF_SIZE];     // Frame being received / sent
+UINT8  mb_len;
+UINT8  mb_rx_bit;               // Data bits sampled of this character
+UINT8  mb_rx_byte;              // Character being shifted in, LSB first
+struct FAULT mb_fault;          // Copy of fault for the 0x200 map
+UINT8  mb_idle;                 // ms since the last byte
+BOOL   mb_ready;                // Complete frame waiting for modbus_poll()
+BOOL   mb_over;                 // Frame was longer than mb_buf
+char   mb_undo[sizeof(trx)];    // Structure before a holding write
+UINT8  mb_age;                  // ms since mb_ready was set
+UINT16 mb_frames, mb_errors;
+UINT32 g_ticks;                 // 1ms ticks from Timer2
+UINT16 g_adc;                   // Latest sample from tick_isr()
+BOOL   g_adc_fresh;             // Set by ISR, cleared by the control loop
+UINT16 g_adc_tick;              // Low 16 bits of g_ticks at that sample
+BOOL   g_acq_on;                // ISR owns the ADC while this is set
+UINT16 g_adc_same;              // Identical samples in a row
+UINT8  g_overruns;              // Samples the loop did not take in a row
+UINT8  g_adc_age;               // ms since the last sample
+UINT16 g_dac;                   // Last DAC code from the control loop
+UINT16 g_dac_cmd;               // 16 bit output command for the dither
+UINT8  g_dac_err;               // Dither error carried to the next tick
+BOOL   g_dither_on;             // tick_isr() owns the DAC while this is set
+UINT16 g_dac_errors;            // Readback mismatches (DAC_READBACK)
+UINT16 g_dac_last;              // Code of the last write, for the echo
+BOOL   g_dac_known;             // g_dac_last has been written
+UINT16 mb_diag[3];              // DAC errors, frames, errors for 0x300
+UINT8  g_adc_seq;               // Bumped by tick_isr() after each sample
+UINT8  g_fault_seq;             // Bumped by fault_latch()
+
+UINT16 adc_snapshot(UINT16 *);
+void   enc_snapshot(struct ENC_SNAP *);
+void   fault_snapshot(struct FAULT *);
+
+//***************************************************************************
+//     DESCRIPTION:        1ms tick, ADC acquisition and safety interlock
+//     RETURN:             None
+//     NOTES:              Each new sample is checked here so a trip drives
+//                         the DAC safe within the sample it was seen in, the
+//                         main loop only reports it.
+//***************************************************************************/
+#INT_TIMER2
+void tick_isr()
+{    UINT16 adc, sum;
+
+     g_ticks++;
+     if (g_enc_idle < 0xffff)
+            {   if (++g_enc_idle == ENC_TIMEOUT_MS)
+                       {    g_enc_period = 0;  // Timer1 is about to wrap
+                            g_enc_first  = TRUE;
+                            if (g_enc_count)   // No capture to close a gate
+                                   {    setup_ccp2(CCP_OFF);
+                                        setup_ccp2(CCP_CAPTURE_FE);
+                                        g_enc_count = FALSE;
+                                   }
+                       }
+                g_enc_seq++;
+            }
+     if (mb_ready)
+            {   if (mb_age < 0xff) mb_age++;
+            }
+     else if (mb_len && ++mb_idle >= MB_GAP_MS)
+            {   mb_age = 0;
+                mb_ready = TRUE;       // 3.5 character gap ends the frame
+            }
+     if (g_enc_count && !g_enc_first && ++g_gate_ms >= ENC_GATE_MS)
+            {   // Edges between the first and last capture in the gate
+                // over the time between them - exact at any speed. Not
+                // closed before the first capture sets g_gate_e0/t0
+                g_gate_ms    = 0;
+                g_gate_edges = g_enc_edges - g_gate_e0;
+                g_gate_time  = g_enc_last - g_gate_t0;
+                g_gate_e0    = g_enc_edges;
+                g_gate_t0    = g_enc_last;
+                if (g_gate_edges < ENC_M_TO_T)
+                       {    setup_ccp2(CCP_OFF);   // Or the mode change can capture
+                            setup_ccp2(CCP_CAPTURE_FE);
+                            g_enc_count  = FALSE;
+                            g_enc_first  = TRUE;
+                            g_enc_period = 0;
+                       }
+                g_enc_seq++;
+            }
+     if (g_dither_on && !fault.cause)
+            {   // First order error feedback, the 4 bits below the DAC
+                // LSB come out as the duty of the LSB over 16 ticks
+                sum = g_dac_cmd + g_dac_err;   // No overflow, cmd <= 0xfff0
+                g_dac_err = sum & 0x0f;
+                dac_transfer(sum >> 4);
+            }
+     if (!g_acq_on) return;
+     if (input(ADC_DRDY))
+            {   if (++g_adc_age >= ADC_TIMEOUT_MS)
+                       {    g_adc_age = 0;
+                            fault_latch(FAULT_ADC_TIMEOUT, g_adc);
+                       }
+                return;
+            }
+     g_adc_age = 0;
+
+     write_adc_byte(0x38);         // Read data register, CH0
+     adc = read_adc_word();
+     if (adc == g_adc)
+            {   if (g_adc_same < 0xffff) g_adc_same++;
+            }
+     else   g_adc_same = 0;
+     if (g_adc_fresh)
+            {   if (g_overruns < 0xff) g_overruns++;
+            }
+     else   g_overruns = 0;
+     g_adc = adc;
+     g_adc_tick = (UINT16)g_ticks;
+     g_adc_fresh = TRUE;
+     g_adc_seq++;
+
+     if (adc >= ADC_SATURATED)            fault_latch(FAULT_ADC_SAT, adc);
+     else if (adc > cal.TRIP_BITS)        fault_latch(FAULT_OVER_MPA, adc);
+     else if (adc < (cal.LV_BITS >> 1))   fault_latch(FAULT_UNDER_MPA, adc);
+     if (g_overruns >= OVERRUN_LIMIT)     fault_latch(FAULT_OVERRUN, adc);
+     if (g_dac > DAC_MID + DAC_DRIVE || g_dac < DAC_MID - DAC_DRIVE)
+            {   // Pressure and motor must move when the valve is driven
+                if (g_adc_same >= STUCK_SAMPLES)     fault_latch(FAULT_ADC_STUCK, adc);
+                if (cal.STALL_MS && g_enc_idle > cal.STALL_MS)
+                                                     fault_latch(FAULT_ENC_STALL, adc);
+            }
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Modbus receive - start bit on RB0/INT0
+//     RETURN:             None
+//     NOTES:              Only starts Timer3 for the middle of bit 0, the
+//                         bits are sampled by modbus_bit_isr(). Returns in
+//                         a few us instead of waiting out the character.
+//***************************************************************************/
+#INT_EXT HIGH
+void modbus_rx_isr()
+{
+     set_timer3(0xffff - MB_BIT_T3 - MB_BIT_T3 / 2);
+     clear_interrupt(INT_TIMER3);
+     enable_interrupts(INT_TIMER3);
+     disable_interrupts(INT_EXT);  // Until the stop bit
+     mb_rx_bit = 0;
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Modbus receive - one bit time on Timer3
+//     RETURN:             None
+//     NOTES:              Samples RB0 in the middle of each data bit and
+//                         of the stop bit. A bad stop bit drops the
+//                         character, the CRC then rejects the frame. The
+//                         CRC is run in modbus_poll(), not here.
+//***************************************************************************/
+#INT_TIMER3 HIGH
+void modbus_bit_isr()
+{
+     set_timer3(get_timer3() - MB_BIT_T3);   // Next centre, less latency
+     if (mb_rx_bit < 8)
+            {   mb_rx_byte >>= 1;
+                if (input(PIN_B0)) mb_rx_byte |= 0x80;
+                mb_rx_bit++;
+                return;
+            }
+     disable_interrupts(INT_TIMER3);
+     clear_interrupt(INT_EXT);
+     enable_interrupts(INT_EXT);   // Line is idle, wait for the next start
+     if (!input(PIN_B0)) return;   // Framing error
+     if (mb_ready) return;         // Last frame not dealt with yet
+     if (mb_len < MB_BUF_SIZE) mb_buf[mb_len++] = mb_rx_byte;
+     else   mb_over = TRUE;        // Answered with exception 3
+     mb_idle = 0;
+}
+
 //******************************************************************* 
 //   Declaration of globals functions
 //*******************************************************************
 void init_pulse_width_counter(void)
 {
-setup_ccp1(CCP_CAPTURE_RE); 
+setup_ccp1(CCP_OFF); 
 setup_ccp2(CCP_CAPTURE_FE); 
-setup_timer_1(T1_INTERNAL); 
+setup_timer_1(T1_INTERNAL | T1_DIV_BY_8); 
+g_enc_count  = FALSE;
+g_enc_first  = TRUE;
+g_enc_period = 0;
+g_gate_edges = 0;
+g_gate_ms    = 0;
 enable_interrupts(GLOBAL); 
 setup_wdt(WDT_ON);
 }
 
 void enable_pulse_width_counter(void)
 {
+g_enc_on = TRUE;
 enable_interrupts(INT_CCP2);
 }
 
-UINT16 get_CCP2_period(void)
+void disable_pulse_width_counter(void)
 {
-UINT16 period;
-period = 2*(pulse_width/5);
-return(period);
+disable_interrupts(INT_CCP2);
+g_enc_on = FALSE;
 }
 
-void disable_pulse_width_counter(void)
+void init_tick(void)
 {
-disable_interrupts(INT_CCP2);
+setup_timer_2(T2_DIV_BY_4, 249, 5);     // 20MHz/4/4/250/5 = 1KHz
+enable_interrupts(INT_TIMER2);
 }
 
-float get_motor_rpm(int1)
+UINT32 get_ticks(void)
 {
-#define   SF   1024 // There are 1024 pulses / rev
-                    // therefore gives 1024Hz = 1RPS.
-UINT16 i=50;
-float32   period, freq, rpm;
+UINT32 t;
+do     t = g_ticks;             // Two equal reads cannot both be torn
+while (t != g_ticks);
+return(t);
+}
+//***************************************************************************
+//     DESCRIPTION:        Consistent copies of the ISR data
+//     RETURN:             adc_snapshot() returns the sample and its tick
+//     NOTES:              Copy, then copy again if the ISR ran meanwhile.
+//                         adc_snapshot() also takes the sample (clears
+//                         g_adc_fresh) inside the retry, so a sample that
+//                         lands during the copy is the one returned.
+//***************************************************************************/
+
+UINT16 adc_snapshot(UINT16 *tick)
+{
+UINT16 adc;
+UINT8  s;
+do     {      s = g_adc_seq;
+              g_adc_fresh = FALSE;
+              adc = g_adc;
+              *tick = g_adc_tick;
+       }
+while (s != g_adc_seq);
+return(adc);
+}
 
-init_pulse_width_counter(); 
-enable_pulse_width_counter(); 
-delay_ms(50);
+void enc_snapshot(struct ENC_SNAP *e)
+{
+UINT8 s;
+do     {      s = g_enc_seq;
+              e->idle   = g_enc_idle;
+              e->period = g_enc_period;
+              e->edges  = g_gate_edges;
+              e->time   = g_gate_time;
+              e->count  = g_enc_count;
+       }
+while (s != g_enc_seq);
+}
+
+void fault_snapshot(struct FAULT *f)
+{
+UINT8 s, i;
+do     {      s = g_fault_seq;
+              for (i=0; i < sizeof(fault); i++)
+                     *((int8 *)f + i) = *((int8 *)&fault + i);
+       }
+while (s != g_fault_seq);
+}
 
-period = (float32)get_CCP2_period();
-freq = 1000000L /period;
-rpm  = (freq / 1024)*60;
-disable_pulse_width_counter(); 
+//***************************************************************************
+//     DESCRIPTION:        Motor speed from the encoder
+//     RETURN:             RPM (1024Hz = 1 RPS)
+//     NOTES:              Uses the counting gate or the last edge period,
+//                         whichever the ISRs are in. If the counter is not
+//                         running it is started for a single reading.
+//***************************************************************************/
+
+float get_motor_rpm(int1)
+{
+float32   rpm;
+BOOL      started = FALSE;
+struct ENC_SNAP e;
+
+if (!g_enc_on)
+       {      init_pulse_width_counter(); 
+              enable_pulse_width_counter(); 
+              delay_ms(3 * ENC_GATE_MS);
+              started = TRUE;
+       }
+enc_snapshot(&e);
+if (e.idle > ENC_TIMEOUT_MS)
+       rpm = 0;
+else if (e.count)
+       rpm = e.time ? (float32)e.edges * (T1_HZ * 60.0 / SF) / e.time : 0;
+else   rpm = e.period ? (T1_HZ * 60.0 / SF) / e.period : 0;
+if (started) disable_pulse_width_counter();
 return(rpm);
 }
 
@@ -271,6 +810,7 @@ fprintf(USB, "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
 fprintf(USB, "\r\n=[ CPU Restarted, Loading NVM ]=\r\n ");
 
 fprintf(USB, "\r\nTerraterm 4.6.3, (Use Courier 10 Pt Font)\r\n"); 
+g_acq_on = FALSE;
 get_restart_cause();
 load_setup_from_nvm();
 if (trx.setup_ok != SETUP_PRESENT)
@@ -278,6 +818,11 @@ if (trx.setup_ok != SETUP_PRESENT)
                init_setup_defaults();
                save_setup_to_nvm();
         }
+load_cal_from_nvm();
+check_fault_latch();
+load_gains_from_nvm();
+init_tick();
+modbus_init();
 fprintf(USB,
 fprintf(USB, "\r\n...........Identifier : %s ", trx.ident);
 fprintf(USB, "\r\n..........Board Ident : %s ", trx.ident);
@@ -300,7 +845,8 @@ while(1)
         timeout = 6;
 
         while(timeout--)
-               {       ch = timed_getc(50000);
+               {       modbus_poll();
+                       ch = timed_getc(50000);
                        restart_wdt(); 
                        if (ch == 27)
                               {
@@ -309,7 +855,7 @@ while(1)
                                       }
                        fprintf(USB, "\r Timeout -[ %Ld ]- ", timeout); 
                        restart_wdt();
-                       delay_ms(1000);
+                       wait_ms(1000);
                }
 
         state = 1;
@@ -342,6 +888,7 @@ char     fmt[40]        ;
 UINT8       n_read=0    ;
 UINT8       n_args      ;
 int                i    ;
+UINT16           adc    ;
 
 arglist[0]  =     &vf0  ;
 arglist[1]  =     &vf1  ;
@@ -387,9 +934,27 @@ case 4:
 	fprintf(USB, "\r\n current ADC value, pressure above this will"); 
 	fprintf(USB, "\r\n trigger an alarm condition, which will also"); 
 	fprintf(USB, "\r\n occur if the ADC value goes out of bounds"); 
-	fprintf(USB, "\r\n Current ADC value : %Lu", read_adc_value(1)); 
+	adc = read_adc_value(1);
+	fprintf(USB, "\r\n Current ADC value : %Lu", adc); 
 	fprintf(USB, "\r\n\n Enter calibration MPa : ");
-	getch();
+	get_string(string, sizeof(string));
+	if (sscanf(string, "%f", arglist) != 1 || vf0 <= 0 || adc <= cal.LV_BITS)
+		{	fprintf(USB, "\r\n Error : Calibration not changed");
+			return(1);
+		}
+	cal.HV_BITS   = adc;
+	cal.MAX_MPA   = vf0;
+	cal.TRIP_BITS = adc;
+	fprintf(USB, "\r\n Safe output (V) [%f] : ", cal.SAFE_DAC * 10.0 / 0xfff - 5);
+	get_string(string, sizeof(string));
+	if (sscanf(string, "%f", arglist) == 1 && vf0 >= -5 && vf0 <= 5)
+		cal.SAFE_DAC = get_dac_bits(vf0);
+	fprintf(USB, "\r\n Encoder stall (ms, 0=Off) [%Lu] : ", cal.STALL_MS);
+	get_string(string, sizeof(string));
+	if (sscanf(string, "%f", arglist) == 1 && vf0 >= 0 && vf0 < 30000)
+		cal.STALL_MS = (int16)vf0;
+	save_cal_to_nvm();
+	set_gain_scale();
 	return(1);
 case 5:
 	if (strstr(trx.fwd, "Fwd")) strcpy(trx.fwd, "Rev");
@@ -414,6 +979,34 @@ case 7:
             exercise_dac();
             fprintf(USB, "\r\n Motor speed: %f", get_motor_rpm(1));
             return(1); 
+      case 10:
+            gain_schedule_menu();
+            return(1);
+      case 11:
+            feed_forward_menu();
+            save_setup_to_nvm();
+            return(1);
+      case 12:
+            show_fault();
+            if (fault.cause)
+                  {     fprintf(USB, "\r\n Clear fault (Y/N) : ");
+                        if (toupper(con_getc()) == 'Y') clear_fault();
+                  }
+            return(1);
+      case 13:
+            estimator_menu();
+            save_setup_to_nvm();
+            return(1);
+      case 14:
+            smith_menu();
+            save_setup_to_nvm();
+            return(1);
+      case 15:
+            prbs_test();
+            return(1);
+      case 16:
+            recipe_menu();
+            return(1);
       default:
             return(0);
       }
@@ -456,36 +1049,649 @@ while(i < max_size)
 		array++; i++;
 	}
 }
+#define     R_SIZE 5
+
+struct TASK
+{    UINT16 lc        ;    // Resume line, 0 = from the top
+     UINT16 period    ;    // ms between releases (control - measured)
+     UINT16 budget    ;    // Timer1 counts one slice may take
+     UINT8  budget_ms ;    // Same rounded up, used to admit a slice
+     UINT32 due       ;    // g_ticks of the next release
+     UINT32 busy      ;    // Timer1 counts used in this window
+     UINT16 worst     ;    // Longest slice
+     UINT16 misses    ;    // Deadlines missed
+     UINT16 overruns  ;    // Slices over budget
+     UINT8  cpu       ;    // % of the last window
+}    task[TASKS];
+
+char   task_name[TASKS][6] = { "CTRL", "ACQ", "TELEM", "CONS", "MBUS", "NVM" };
+BOOL   g_kernel_stop;
+UINT32 g_cpu_t0;                // Start of the CPU use window
+#bit   TX_READY = getenv("BIT:TXIF")
+
+float  ctl_integ[R_SIZE];       // Control task state between samples
+float  ctl_mvstart, ctl_rsplast;
+float  ctl_bump, ctl_bump_k;         // Recipe switch offset and decay
+float  ctl_volts_old;                // Output before the switch
+BOOL   ctl_bump_due;                 // Take the offset on the next pass
+float  ctl_mvfb, ctl_smith_last;   // MV with the Smith correction
+UINT32 ctl_tlast;
+UINT16 ctl_count, ctl_tick;
+
+signed int32 est_x, est_v;      // Estimate in ADC counts and counts per
+                                // sample, both Q8
+signed int16 est_alpha, est_beta;  // Q15, 0 = estimator off
+float  est_scale;               // Q8 counts to MPa
+BOOL   est_primed;
+
+signed int32 sm_y;              // Smith model output, ADC counts Q8
+signed int32 sm_ring[SMITH_RING];  // Past model outputs
+signed int16 sm_a;              // Q15 fraction of the gap closed per sample
+signed int16 sm_k;              // Q8 counts per DAC LSB
+UINT8  sm_d, sm_pos;            // Dead time in samples (0 = off), ring slot
+UINT16 sm_dac;                  // DAC code the model is driven by
+
+//***************************************************************************
+//    DESCRIPTION:      Alpha-beta gains from the noise settings
+//    RETURN:           None
+//    NOTES:            Steady state Kalman gains for a constant rate
+//                      model (Kalata) - tracking index L = q.T^2/r, with
+//                      T the ADC sample period. Float maths, run once
+//                      when the loop starts.
+//***************************************************************************/
+
+void est_init(void)
+{
+float lam, r, a, b, t;
+
+est_primed = FALSE;
+est_alpha  = 0;
+est_beta   = 0;
+est_scale  = cal.MAX_MPA / ((float)(cal.HV_BITS - cal.LV_BITS) * 256.0);
+if (trx.est_q <= 0 || trx.est_r <= 0) return;
+t   = CONTROL_MS / 1000.0;
+lam = trx.est_q * t * t / trx.est_r;
+r   = (4 + lam - sqrt(8 * lam + lam * lam)) / 4;
+a   = 1 - r * r;
+b   = 2 * (2 - a) - 4 * sqrt(1 - a);
+est_alpha = (signed int16)(a * 32767);
+est_beta  = (signed int16)(b * 32767);
+if (est_alpha < 1) est_alpha = 1;
+if (est_beta < 1)  est_beta = 1;
+}
+//***************************************************************************
+//    DESCRIPTION:      Smith predictor model from the setup
+//    RETURN:           None
+//    NOTES:            Float maths, run once when the loop starts. Needs
+//                      est_scale so call after est_init().
+//***************************************************************************/
+
+void smith_init(void)
+{
+float k;
+UINT8 i;
+
+sm_d   = 0;
+sm_y   = 0;
+sm_pos = 0;
+sm_dac = DAC_MID;
+for (i=0; i < SMITH_RING; i++) sm_ring[i] = 0;
+if (trx.sp_km == 0 || trx.sp_tau <= 0 || trx.sp_dead <= 0) return;
+sm_a = (signed int16)(32767 * (1 - exp(-(CONTROL_MS / 1000.0) / trx.sp_tau)));
+if (sm_a < 1) sm_a = 1;
+k = trx.sp_km * (10.0 / 4095) * (cal.HV_BITS - cal.LV_BITS) / cal.MAX_MPA * 256;
+if (k > 32767)  k = 32767;
+if (k < -32767) k = -32767;
+sm_k = (signed int16)k;
+k = trx.sp_dead / CONTROL_MS + 0.5;
+if (k < 1) k = 1;
+if (k > SMITH_RING - 1) k = SMITH_RING - 1;
+sm_d = (UINT8)k;
+}
+//***************************************************************************
+//    DESCRIPTION:      Step the Smith model with the last DAC output
+//    RETURN:           None, correction in loop.smith (MPa)
+//    NOTES:            Fixed point first order lag, the gap to the target
+//                      is taken in whole counts (+/-32767). The ring keeps
+//                      each output so the correction is model now less
+//                      model sm_d samples ago.
+//***************************************************************************/
+
+void smith_update(void)
+{
+signed int32 gap;
+signed int16 u, e;
+
+if (!sm_d)
+       {      loop.smith = 0;
+              return;
+       }
+u   = (signed int16)sm_dac - DAC_MID;
+gap = ((signed int32)u * sm_k - sm_y) >> 8;
+if (gap > 32767)       e = 32767;
+else if (gap < -32767) e = -32767;
+else                   e = (signed int16)gap;
+sm_y += ((signed int32)e * sm_a) >> 7;
+sm_ring[sm_pos] = sm_y;
+loop.smith = (float)(sm_y - sm_ring[(sm_pos - sm_d) & (SMITH_RING - 1)]) * est_scale;
+sm_pos = (sm_pos + 1) & (SMITH_RING - 1);
+}
+//***************************************************************************
+//    DESCRIPTION:      One estimator step with a new ADC sample
+//    RETURN:           None
+//    NOTES:            Fixed cost, two 16x16 multiplies. The residual is
+//                      taken in Q4 counts and held to +/-2047 counts so a
+//                      large step is followed over a few samples instead
+//                      of throwing the rate.
+//***************************************************************************/
+
+void est_update(UINT16 z)
+{
+signed int32 xp, r;
+signed int16 e;
+
+if (!est_primed)
+       {      est_x = (signed int32)z << 8;
+              est_v = 0;
+              est_primed = TRUE;
+              return;
+       }
+xp = est_x + est_v;
+r  = (((signed int32)z << 8) - xp) >> 4;
+if (r > 32767)       e = 32767;
+else if (r < -32767) e = -32767;
+else                 e = (signed int16)r;
+est_x = xp + (((signed int32)e * est_alpha) >> 11);
+est_v += ((signed int32)e * est_beta) >> 11;
+}
+
+struct LOOP tel;                // Copy of loop for the record being sent
+float  tel_sp;
+BOOL   g_log_due;               // tel holds a record not yet sent
+BOOL   g_tel_busy;              // Telemetry part way through a record
+BOOL   g_show_tasks;
+char   tx_buf[TX_BUF_SIZE];     // Console output not yet sent
+UINT8  tx_len, tx_pos;
+BOOL   g_con_busy;              // Operator typing a setpoint
+char   con_buf[12];
+UINT8  con_len;
+char   con_ch;
+UINT8  tab_i;
+BOOL   g_recipe_ready;          // Console has staged a recipe in buffer
+BOOL   g_save_setup;            // Persistence task to write trx
+BOOL   g_save_gains;            // Persistence task to write gs
+BOOL   g_nvm_busy;
+BOOL   g_kernel_on;             // run_pid() tasks are being scheduled
+UINT8  nvm_i, nvm_len;
+UINT16 nvm_addr;
+char   nvm_buf[sizeof(trx)];    // trx or gs as it was when the save started
+
+//***************************************************************************
+//    DESCRIPTION:      Send what the UART will take of tx_buf
+//    RETURN:           TRUE once tx_buf is empty
+//    NOTES:            Never waits, only writes while TXIF is set.
+//***************************************************************************/
+
+BOOL tx_send(void)
+{
+while (tx_pos < tx_len && TX_READY)
+       fputc(tx_buf[tx_pos++], USB);
+if (tx_pos < tx_len) return(FALSE);
+tx_len = tx_pos = 0;
+return(TRUE);
+}
+
+void tx_start(void)
+{
+tx_len = strlen(tx_buf);
+tx_pos = 0;
+}
+//***************************************************************************
+//    DESCRIPTION:      Control task - one pass of the PID law per sample
+//    RETURN:           None
+//    NOTES:            Same arithmetic as the old run_pid() loop (and
+//                      host/pid_law.h). Hands a copy to telemetry when it
+//                      has finished the last record.
+//***************************************************************************/
+
+void task_control(void)
+{
+UINT32 now, dt;
+float  step;
+UINT16 tick;
+
+if (fault.cause)
+       {      g_kernel_stop = TRUE;        // ISR has already made the DAC safe
+              return;
+       }
+output_toggle(LED_STATUS);
+loop.adc = adc_snapshot(&tick);
+if (tick - ctl_tick > 0 && tick - ctl_tick < 4 * CONTROL_MS)
+       task[TASK_CONTROL].period = tick - ctl_tick;
+ctl_tick = tick;
+if (g_recipe_ready) recipe_switch();
+get_scheduled_gains(loop.adc, &loop.Kp, &loop.Ki, &loop.Kd);
+now = get_ticks();
+dt = now - ctl_tlast;
+ctl_tlast = now;
+step = trx.rate * dt / (1000 * MS_PER_MIN);  // KPa/min to MPa
+if (trx.rate <= 0) trx.rsp = trx.tsp;
+else if (trx.rsp < trx.tsp)
+       {      trx.rsp += step;
+              if (trx.rsp > trx.tsp) trx.rsp = trx.tsp;
+       }
+else if (trx.rsp > trx.tsp)
+       {      trx.rsp -= step;
+              if (trx.rsp < trx.tsp) trx.rsp = trx.tsp;
+       }
+loop.ff = 0;
+if (trx.ff_on)
+       {      if (dt) loop.ff = trx.ff_kv * (trx.rsp - ctl_rsplast) * MS_PER_MIN / dt;
+              if (trx.ff_kpl > 0) loop.ff += trx.rsp / trx.ff_kpl;
+       }
+ctl_rsplast = trx.rsp;
+if (ctl_count % R_SIZE == 0)
+       {      ctl_count = 0;
+              ctl_mvstart = ctl_mvfb;
+       }
+loop.mv = get_mpa(loop.adc);
+est_update(loop.adc);
+loop.mvf  = (float)(est_x - ((signed int32)cal.LV_BITS << 8)) * est_scale;
+loop.rate = (float)est_v * est_scale;
+smith_update();
+ctl_mvfb = loop.mv + loop.smith;     // MV as the PID sees it
+if (est_alpha)
+       loop.D = -loop.rate - (loop.smith - ctl_smith_last);
+else if (ctl_count == 0)
+       loop.D = (ctl_mvstart - ctl_mvfb) / R_SIZE;
+ctl_smith_last = loop.smith;
+ctl_integ[ctl_count] = trx.rsp - ctl_mvfb;
+loop.I = (ctl_integ[0]+ctl_integ[1]+ctl_integ[2]+ctl_integ[3]+ctl_integ[4])/(R_SIZE*cal.MAX_MPA);
+loop.P = get_dac_volts(ctl_mvfb, trx.rsp, trx.pb);
+if (loop.P != 5 && loop.P != -5)
+       {      loop.volts = (loop.Kp*loop.P)+(loop.Ki*loop.I)+(loop.Kd*loop.D)+loop.ff;
+              if (loop.volts > 5) loop.volts = +5;
+              if (loop.volts < -5) loop.volts = -5;
+       }
+else   loop.volts = (loop.Kp*loop.P)+loop.ff;  // Is outside proportional band
+
+if (loop.volts > 5) loop.volts = 5;
+if (ctl_bump_due)
+       {      ctl_bump = ctl_volts_old - loop.volts;
+              ctl_bump_due = FALSE;
+       }
+if (ctl_bump != 0)
+       {      loop.volts += ctl_bump;
+              ctl_bump *= ctl_bump_k;
+              if (ctl_bump > -0.001 && ctl_bump < 0.001) ctl_bump = 0;
+              if (loop.volts > 5) loop.volts = 5;
+              if (loop.volts < -5) loop.volts = -5;
+       }
+set_dac_output(get_dac_bits16(loop.volts));
+sm_dac = g_dac;
+
+if (!g_log_due && !g_tel_busy)
+       {      memcpy(&tel, &loop, sizeof(loop));
+              tel_sp = trx.rsp;
+              g_log_due = TRUE;
+       }
+ctl_count++;    loop.lc++;
+}
+//***************************************************************************
+//    DESCRIPTION:      Change to the recipe staged in buffer
+//    RETURN:           None
+//    NOTES:            Called by the control task between passes. The
+//                      pass that follows works out the new law's output
+//                      and carries the step from the last output as an
+//                      offset, decaying by exp(-period / RECIPE_BUMP_MS)
+//                      per pass (note 21). This holds for Ki 0, P outside
+//                      the band and a D restart alike. The setpoint
+//                      ramps from where it is at the new rate. Estimator
+//                      and Smith model only restart if their terms
+//                      changed.
+//***************************************************************************/
+
+void recipe_switch(void)
+{
+float q, r, km, tau, dead;
+
+g_recipe_ready = FALSE;
+ctl_volts_old = loop.volts;          // Old P, I, D, ff and any offset
+ctl_bump_k = exp(-(float)task[TASK_CONTROL].period / RECIPE_BUMP_MS);
+ctl_bump_due = TRUE;
+q  = trx.est_q;   r   = trx.est_r;
+km = trx.sp_km;   tau = trx.sp_tau;   dead = trx.sp_dead;
+recipe_apply();
+if (q != trx.est_q || r != trx.est_r) est_init();
+if (km != trx.sp_km || tau != trx.sp_tau || dead != trx.sp_dead)
+       {      smith_init();
+              loop.smith = 0;
+              ctl_smith_last = 0;
+              ctl_mvfb = loop.mv;
+       }
+g_save_setup = TRUE;
+}
+//***************************************************************************
+//    DESCRIPTION:      Acquisition task - encoder speed
+//    RETURN:           None
+//    NOTES:            The ADC is sampled in tick_isr() (note 12), this
+//                      keeps loop.rpm current for telemetry and Modbus.
+//***************************************************************************/
+
+void task_acq(void)
+{
+loop.rpm = get_motor_rpm(1);
+}
+//***************************************************************************
+//    DESCRIPTION:      Telemetry task - log records and the task table
+//    RETURN:           None
+//    NOTES:            Same text as before, formatted a field group per
+//                      slice. If the UART falls behind, records are
+//                      skipped (Count shows the gap) instead of the loop
+//                      waiting on the console.
+//***************************************************************************/
+
+void task_telemetry(void)
+{
+PT_BEGIN(TASK_TELEMETRY)
+while(1)
+       {      PT_WAIT(TASK_TELEMETRY, (g_log_due || g_show_tasks) && !g_con_busy);
+              PT_WAIT(TASK_TELEMETRY, tx_send());
+              if (g_show_tasks)
+                     {      g_show_tasks = FALSE;
+                            g_tel_busy = TRUE;
+                            for (tab_i = 0; tab_i <= TASKS; tab_i++)
+                                   {      task_line(tab_i);
+                                          PT_WAIT(TASK_TELEMETRY, tx_send());
+                                   }
+                            g_tel_busy = FALSE;
+                            continue;
+                     }
+              g_log_due = FALSE;
+              if (tel.lc % LOG_EVERY)
+                     {      strcpy(tx_buf, ".");
+                            tx_start();
+                            continue;
+                     }
+              g_tel_busy = TRUE;
+              sprintf(tx_buf, "\r\nCount:%04Lu, SP:%3.2f,MV:%3.2f,ADC:%05Lu (0x%04LX),",
+                      tel.lc, tel_sp, tel.mv, tel.adc, tel.adc);
+              tx_start();
+              PT_WAIT(TASK_TELEMETRY, tx_send());
+              sprintf(tx_buf, "DAC/PID:%2.2f(V),ERR:%f,", tel.volts, tel_sp-tel.mv);
+              tx_start();
+              PT_WAIT(TASK_TELEMETRY, tx_send());
+              sprintf(tx_buf, "(P:%f,I:%f,D:%f),", tel.P, tel.I, tel.D);
+              tx_start();
+              PT_WAIT(TASK_TELEMETRY, tx_send());
+              sprintf(tx_buf, "RPM:%f", tel.rpm);
+              tx_start();
+              g_tel_busy = FALSE;
+       }
+PT_END(TASK_TELEMETRY)
+}
+//***************************************************************************
+//    DESCRIPTION:      Console task - <ESC>, '?' setpoint, 'R' recipe, 'T' tasks
+//    RETURN:           None
+//    NOTES:            The loop keeps running while a setpoint is typed,
+//                      telemetry is held off until it is entered.
+//***************************************************************************/
+
+void task_console(void)
+{
+float sp;
+
+PT_BEGIN(TASK_CONSOLE)
+while(1)
+       {      PT_WAIT(TASK_CONSOLE, kbhit());
+              con_ch = getc();
+              if (con_ch == 27)
+                     {      g_kernel_stop = TRUE;
+                            continue;
+                     }
+              if (toupper(con_ch) == 'T')
+                     {      g_show_tasks = TRUE;
+                            continue;
+                     }
+              if (toupper(con_ch) == 'R')
+                     {      PT_WAIT(TASK_CONSOLE, !g_tel_busy && tx_send());
+                            g_con_busy = TRUE;
+                            sprintf(tx_buf, "\r\nRecipe (0-%u): ", RECIPE_SLOTS - 1);
+                            tx_start();
+                            PT_WAIT(TASK_CONSOLE, kbhit() && tx_send());
+                            con_ch = getc() - '0';
+                            if (!g_recipe_ready && recipe_load(con_ch, con_buf))
+                                   {      g_recipe_ready = TRUE;    // Taken on the next pass
+                                          sprintf(tx_buf, "\r\nRecipe %u: %s", con_ch, con_buf);
+                                   }
+                            else   strcpy(tx_buf, "\r\nRecipe not changed");
+                            tx_start();
+                            g_con_busy = FALSE;
+                            continue;
+                     }
+              if (con_ch != '?') continue;
+
+              PT_WAIT(TASK_CONSOLE, !g_tel_busy && tx_send());
+              g_con_busy = TRUE;
+              strcpy(tx_buf, "\r\nEnter a setpoint: ");
+              tx_start();
+              con_len = 0;
+              do     {      PT_WAIT(TASK_CONSOLE, kbhit() && tx_send());
+                            con_ch = getc();
+                            if (con_ch == 8 && con_len)
+                                   con_len--;
+                            else if (con_ch >= ' ' && con_len < sizeof(con_buf) - 1)
+                                   con_buf[con_len++] = con_ch;
+                            else if (con_ch != '\r') continue;
+                            fputc(con_ch, USB);     // Echo, TXIF was set
+                     }
+              while (con_ch != '\r' && con_ch != 27);
+              con_buf[con_len] = 0;
+              sp = atof(con_buf);
+              if (con_ch == '\r' && con_len && sp >= 0 && sp <= cal.MAX_MPA)
+                     {      trx.tsp = sp;
+                            g_save_setup = TRUE;
+                            sprintf(tx_buf, "\r\nSetpoint: %f", trx.tsp);
+                     }
+              else   strcpy(tx_buf, "\r\nSetpoint not changed");
+              tx_start();
+              g_con_busy = FALSE;
+       }
+PT_END(TASK_CONSOLE)
+}
+
+void task_modbus(void)
+{
+modbus_poll();
+}
+//***************************************************************************
+//    DESCRIPTION:      Persistence task - save trx or gs a byte per slice
+//    RETURN:           None
+//    NOTES:            Only bytes that differ are written (4ms each).
+//                      trx is copied first, the control task moves rsp
+//                      between slices and a float must not be saved
+//                      half old and half new.
+//***************************************************************************/
+
+void task_persist(void)
+{
+PT_BEGIN(TASK_PERSIST)
+while(1)
+       {      PT_WAIT(TASK_PERSIST, g_save_setup || g_save_gains);
+              g_nvm_busy = TRUE;
+              if (g_save_setup)
+                     {      g_save_setup = FALSE;
+                            memcpy(nvm_buf, &trx, sizeof(trx));
+                            nvm_addr = 0;
+                            nvm_len = sizeof(trx);
+                     }
+              else   {      g_save_gains = FALSE;
+                            memcpy(nvm_buf, &gs, sizeof(gs));
+                            nvm_addr = GS_EEPROM_ADDR;
+                            nvm_len = sizeof(gs);
+                     }
+              for (nvm_i = 0; nvm_i < nvm_len; nvm_i++)
+                     {      if (read_eeprom(nvm_addr + nvm_i) == nvm_buf[nvm_i]) continue;
+                            write_eeprom(nvm_addr + nvm_i, nvm_buf[nvm_i]);
+                            PT_YIELD(TASK_PERSIST);
+                     }
+              g_nvm_busy = FALSE;
+       }
+PT_END(TASK_PERSIST)
+}
+
+void task_call(UINT8 t)
+{
+switch(t)
+       {      case TASK_CONTROL:   task_control();   break;
+              case TASK_ACQ:       task_acq();       break;
+              case TASK_TELEMETRY: task_telemetry(); break;
+              case TASK_CONSOLE:   task_console();   break;
+              case TASK_MODBUS:    task_modbus();    break;
+              case TASK_PERSIST:   task_persist();   break;
+       }
+}
+
+void task_set(UINT8 t, UINT16 period, UINT8 budget_ms)
+{
+task[t].lc        = 0;
+task[t].period    = period;
+task[t].budget_ms = budget_ms;
+task[t].budget    = (UINT16)budget_ms * T1_PER_MS;
+task[t].due       = g_cpu_t0;
+task[t].busy      = 0;
+task[t].worst     = 0;
+task[t].misses    = 0;
+task[t].overruns  = 0;
+task[t].cpu       = 0;
+}
+//***************************************************************************
+//    DESCRIPTION:      One line of the task table into tx_buf
+//    RETURN:           None
+//    NOTES:            t == TASKS gives the idle line.
+//***************************************************************************/
+
+void task_line(UINT8 t)
+{
+UINT8 i, used = 0;
+
+if (t == TASKS)
+       {      for (i=0; i < TASKS; i++) used += task[i].cpu;
+              sprintf(tx_buf, "\r\nIDLE\tCPU:%3u%%", used < 100 ? 100 - used : 0);
+       }
+else   sprintf(tx_buf, "\r\n%s\tCPU:%3u%% Worst:%2.2fms Budget:%ums Miss:%Lu Over:%Lu",
+               task_name[t], task[t].cpu, (float)task[t].worst / T1_PER_MS,
+               task[t].budget_ms, task[t].misses, task[t].overruns);
+tx_start();
+}
+//***************************************************************************
+//    DESCRIPTION:      Start the kernel - all tasks from the top
+//    RETURN:           None
+//    NOTES:            Periods in ms, budgets in ms of Timer1 time.
+//***************************************************************************/
+
+void kernel_init(void)
+{
+g_cpu_t0 = get_ticks();
+task_set(TASK_CONTROL,   CONTROL_MS,  6);   // Float maths and the DAC write
+task_set(TASK_ACQ,       ENC_GATE_MS, 1);
+task_set(TASK_TELEMETRY, 2,           5);   // One sprintf per slice
+task_set(TASK_CONSOLE,   10,          1);
+task_set(TASK_MODBUS,    CONTROL_MS,  14);  // MB_LOOP_REGS reply is 13ms
+task_set(TASK_PERSIST,   5,           5);   // One EEPROM byte
+do     ctl_tick = g_adc_tick;
+while (ctl_tick != g_adc_tick);
+ctl_count = 0;
+est_init();
+smith_init();
+ctl_mvfb = loop.mv;
+ctl_smith_last = 0;
+for (tab_i = 0; tab_i < R_SIZE; tab_i++) ctl_integ[tab_i] = 0;
+ctl_bump = 0;
+ctl_bump_due = FALSE;
+g_kernel_stop = FALSE;
+g_log_due = g_tel_busy = g_show_tasks = g_con_busy = FALSE;
+g_save_setup = g_save_gains = g_nvm_busy = FALSE;
+tx_len = tx_pos = 0;
+}
+
+void kernel_window(UINT32 now)
+{
+UINT8  t;
+UINT32 pc;
+
+for (t=0; t < TASKS; t++)
+       {      pc = task[t].busy / CPU_PERCENT;
+              task[t].cpu  = pc > 100 ? 100 : (UINT8)pc;
+              task[t].busy = 0;
+       }
+g_cpu_t0 = now;
+}
+//***************************************************************************
+//    DESCRIPTION:      Run tasks until <ESC> or a fault
+//    RETURN:           None
+//    NOTES:            Control runs as soon as a sample is in. Another task
+//                      runs when it is due and its budget fits before the
+//                      next sample, so no slice can delay control (if a
+//                      sample is two periods late the ADC timeout will
+//                      trip, the others run meanwhile). Timer1
+//                      times each slice (interrupts included). A task
+//                      starting a whole period late, or control finishing
+//                      after the next sample was due, is a deadline miss.
+//***************************************************************************/
+
+void kernel_run(void)
+{
+UINT8  t;
+UINT16 since, t0, el;
+UINT32 now;
+
+g_kernel_on = TRUE;
+while (!g_kernel_stop)
+       {      restart_wdt();
+              now = get_ticks();
+              if (now - g_cpu_t0 >= CPU_WINDOW_MS) kernel_window(now);
+              if (g_adc_fresh || fault.cause) t = TASK_CONTROL;
+              else
+                     {      since = (UINT16)now - ctl_tick;
+                            for (t=1; t < TASKS; t++)
+                                   if ((signed int32)(now - task[t].due) >= 0
+                                       && (since + task[t].budget_ms < task[TASK_CONTROL].period
+                                           || since >= 2 * task[TASK_CONTROL].period))
+                                          break;
+                            if (t == TASKS) continue;
+                            if (now - task[t].due >= task[t].period) task[t].misses++;
+                            task[t].due += task[t].period;
+                            if ((signed int32)(now - task[t].due) >= 0)
+                                   task[t].due = now + task[t].period; // No catching up
+                     }
+              t0 = get_timer1();
+              task_call(t);
+              el = get_timer1() - t0;
+              task[t].busy += el;
+              if (el > task[t].worst)  task[t].worst = el;
+              if (el > task[t].budget) task[t].overruns++;
+              if (t == TASK_CONTROL && !g_kernel_stop
+                  && (UINT16)get_ticks() - ctl_tick >= task[TASK_CONTROL].period)
+                     task[t].misses++;
+       }
+g_kernel_on = FALSE;
+}
 //***************************************************************************
 //    DESCRIPTION:      Converts string pointed to by s to a float
 //    RETURN:           None
 //    NOTES:            Code for PID Loop needs to be added here.
 //                      Uses Kp, Ki and Kd to determine loop output.
 //***************************************************************************/ 
-#define     R_SIZE 5
 
 void 	run_pid(void)
-{     	float integ[R_SIZE];
-	float P, I, D; 
-	float mvstart; 
-	float mvnew; 
-	float mvlast; 
-	float sp, pb, vm; 
-	float volts;
-	UINT16 ndata, ldata, dac, adc; 
-	UINT16 count, lc = 0          ;
-	UINT16 reset = R_SIZE;
-	UINT16 retries = 0            ;
-	INT8  *args[4]                ;
-	char command[20], ch          ;
-	char  fmt[4]                  ;
-
-	args[0]     =     &sp         ;
-	args[1]     =     &pb         ;
-
-	// arglist[1] =   &vf1        ;
-	// arglist[2] =   &vf2        ;
+{     	int8  i                       ;
 
+	if (fault.cause)
+		{	show_fault();
+			fprintf(USB, "\r\n Loop not started, clear the alarm first");
+			return;
+		}
 	fprintf(USB, "\r\n\nPID Test Program Vo=(Kp*P)+(Ki*I)+(Kd*D)");
 	fprintf(USB "\r\nUses Loop Gain only within proportional band"); 
 //    	enable_interrupts(INT_RDA);
@@ -496,70 +1702,43 @@ void 	run_pid(void)
 	init_ad7705(1);
 	fprintf(USB, "\r\nCH0 Zero : %Lu", read_zero_scale(0)); 
 	fprintf(USB, "\r\nCH1 Zero : %Lu", read_zero_scale(1)); 
-	fprintf(USB, "\r\n Starting PID Control Loop with (Kp=%f,Ki=%f,Kd=%f)
-..<ESC> to Exit.\r\n", trx.Kp, trx.Ki, trx.Kd);
+	fprintf(USB, "\r\n Starting PID Control Loop with (Kp=%f,Ki=%f,Kd=%f,EstQ=%f,EstR=%f,SmKm=%f,SmTau=%f,SmDead=%f)
+..<ESC> to Exit.\r\n", trx.Kp, trx.Ki, trx.Kd, trx.est_q, trx.est_r, trx.sp_km, trx.sp_tau, trx.sp_dead);
 	//    enable_interrupts(INT_RDA);
 	//    enable_pulse_width_counter();
-	while(1)
-            {
-            restart_wdt();
-            output_toggle(LED_STATUS);
-            //    - this runs for interrupt now.
-            adc=get_valid_adc_data(0);
-            if (count % reset == 0)
-                  {     count = 0;
-                        mvstart = mvnew;
-                  } 
-            mvlast = mvnew;
-            mvnew = get_mpa(adc);
-            if (count == 0)
-                  { 
-                  D=(mvstart-mvnew)/reset;
-                  }
-            integ[count] =    trx.tsp-mvnew;
-      I = (integ[0]+integ[1]+integ[2]+integ[3]+integ[4])/(R_SIZE*cal.MAX_MPA); 
-            P = get_dac_volts(mvnew, trx.tsp, trx.pb);
-            if (P != 5 && P!=-5)
-                  {
-                  volts = (trx.Kp*P)+(trx.Ki*I)+(trx.Kd*D);
-                  if (volts > 5) volts = +5;
-                  if (volts < -5) volts = -5;
-                  }
-            else volts = trx.Kp*P;  // Is outside proportional band
-
-            if (volts > 5) volts = 5;
-            dac   = get_dac_bits(volts);
-
-            write_dac(dac&0xfff); 
-            write_dac(dac&0xfff);
-
-            if (lc % 20 == 0)
-		{
-fprintf(USB, "\r\nCount:%04Lu, SP:%3.2f,MV:%3.2f,ADC:%05Lu (0x%04LX),", lc, trx.tsp, mvnew, adc, adc);
-fprintf(USB, "DAC/PID:%2.2f(V),ERR:%f,(P:%f,I:%f,D:%f),", volts, trx.tsp-mvnew, P,I,D);
-fprintf(USB, "RPM:%f", get_motor_rpm(1));
+	trx.rsp = get_mpa(get_valid_adc_data(0));  // Ramp from where we are
+	ctl_rsplast = trx.rsp;
+	ctl_tlast = get_ticks();
+	init_pulse_width_counter();
+	enable_pulse_width_counter();
+	g_enc_idle = 0;
+	g_adc_same = 0;
+	g_overruns = 0;
+	g_adc_age = 0;
+	g_adc_fresh = FALSE;
+	g_dac_err = 0;
+	g_acq_on = TRUE;                // tick_isr() reads the ADC from here
+	g_dither_on = TRUE;             // and drives the DAC
+	loop.lc = 0;
+	kernel_init();
+	kernel_run();
+	g_acq_on = FALSE;
+	g_dither_on = FALSE;            // DAC holds the last code (safe if faulted)
+	disable_pulse_width_counter();
+	while (!tx_send()) restart_wdt();
+	if (fault.cause)
+		{	fault_save();
+			show_fault();
+			return;
 		}
-            else  putchar('.');
-
-            count++;    lc++;
-            ch    = timed_getc(5000);
-            if (ch == 27)
-		{     	disable_interrupts(INT_RDA);
-                        disable_pulse_width_counter();
-                        return;     //    Return a null string
+	while (g_save_setup || g_save_gains || g_nvm_busy)
+		{	restart_wdt();
+			task_persist();
 		}
-            else if (ch == '?')
-		{     	setup_wdt(WDT_ON);
-                        disable_interrupts(INT_RDA);
-                        enable_interrupts(GLOBAL);
-                        fprintf(USB, "\r\nEnter a setpoint: "); 
-                        get_string(command, 10); 
-                        strcpy(fmt,"%f");
-                        sscanf(command, fmt, args);
-                        fprintf(USB, "\r\nSetpoint: %f - press a key", sp); 
-                        getch();
+	for (i=0; i <= TASKS; i++)
+		{	task_line(i);
+			while (!tx_send()) restart_wdt();
 		}
-	}
 }
 //***************************************************************************
 //    DESCRIPTION:      Converts string pointed to by s to a float
@@ -575,7 +1754,11 @@ fprintf(USB, "\r\nCurrent Parms -> MV : %03.2f (MPa), TSP : %03.2f (MPa), Rate :
 %2.2f (KPa/Min)", trx.mv, trx.tsp, trx.rate);
 fprintf(USB, "\r\nConfig PID -> Kp : %3.2f,        Ki : %3.2f,        Kd
 : %3.2f \r\n ", trx.Kp, trx.Ki, trx.Kd);
-fprintf(USB, "\r\nMode : %s    PB : %f (MPa) \r\n ", trx.fwd, trx.pb );
+fprintf(USB, "\r\nMode : %s    PB : %f (MPa)    Gain Schedule : %s    FF : %s\r\n ",
+trx.fwd, trx.pb, gs.enabled ? "On" : "Off", trx.ff_on ? "On" : "Off");
+#if DAC_READBACK
+fprintf(USB, "\r\nDAC readback errors : %Lu\r\n ", get_dac_errors());
+#endif
 fprintf(USB, "\r\n\t1. Reset CPU");
 fprintf(USB, "\r\n\t2. Enter PID/Rate Values");
 fprintf(USB, "\r\n\t3. Enter SP (MPa)");
@@ -585,6 +1768,14 @@ fprintf(USB, "\r\n\t6. Run PID Control Loop");
 fprintf(USB, "\r\n\t7. Load Defaults (& Save)");;
 fprintf(USB, "\r\n\t8. Save Setup to NVM");
 fprintf(USB, "\r\n\t9. DAC, ADC & Encoder Tests");
+fprintf(USB, "\r\n\tG. Gain Schedule Table");
+fprintf(USB, "\r\n\tF. Feed-forward Setup");
+fprintf(USB, "\r\n\tA. Show/Clear Alarm");
+fprintf(USB, "\r\n\tE. Estimator (D term) Setup");
+fprintf(USB, "\r\n\tS. Smith Predictor Setup");
+fprintf(USB, "\r\n\tX. PRBS Excitation Test");
+fprintf(USB, "\r\n\tR. Recipes");
+if (fault.cause) show_fault();
 fprintf(USB, "\r\n\r\n Enter command : ");
 }
 //***************************************************************************
@@ -603,6 +1794,8 @@ fprintf(USB, "\r\n...........Rate : %f ", trx.rate);
 fprintf(USB, "\r\n............TSP : %f ", trx.tsp);
 fprintf(USB, "\r\n............RSP : %f ", trx.rsp);
 fprintf(USB, "\r\n              PB : %f ", trx.pb);
+fprintf(USB, "\r\n    FF Kv (V/MPa/min) : %f ", trx.ff_kv);
+fprintf(USB, "\r\n    FF Plant (MPa/V) : %f ", trx.ff_kpl);
 fprintf(USB, "\r\n           Setup : %02x \r\n", trx.setup_ok);
 }
 //***************************************************************************
@@ -616,10 +1809,8 @@ void init_setup_defaults(void)
 init_ad7705(1);
 fprintf(USB, "\r\n\n================( Loading/Saving default Setup Values 
 )================\r\n ");
-//     Load calibration defaults ...
-cal.LV_BITS =        12000;
-cal.HV_BITS =        60000;
-cal.MAX_MPA =        300 ;
+init_cal_defaults();
+save_cal_to_nvm();
 
 strncpy(trx.ident,  DEFAULT_STRING, sizeof(DEFAULT_STRING));
 trx.Kp     = 5.0          ;
@@ -630,6 +1821,14 @@ trx.tsp    = 220.0                       ;// Target setpoint in MPa
 trx.rate   = 20.0                        ;// Ramp rate in KPa/min
 trx.pb   = 20.0                          ;// Proportional band in MPa
 trx.mverr = -1                           ;// Null value MV is 0 initially
+trx.ff_kv  = 0                           ;// No feed-forward until tuned
+trx.ff_kpl = 0                           ;
+trx.ff_on  = FALSE                       ;
+trx.est_q  = 5.0                         ;// Estimator alpha 0.25, beta 0.035
+trx.est_r  = 0.05                        ;// at 50Hz
+trx.sp_km  = 0                           ;// No Smith predictor until
+trx.sp_tau = 1.0                         ;// the cell is identified
+trx.sp_dead = 0                          ;
 strcpy(trx.fwd,  "Fwd");                 ;// Forward acting PID loop
 trx.mv = get_mpa(get_valid_adc_data(0));// Null value is stored 
 trx.setup_ok = SETUP_PRESENT             ;// Setup marked as OK.
@@ -646,7 +1845,7 @@ show_values();
 
 UINT8  get_state(void)
 {      BYTE ch;
-ch  =  getchar();
+ch  =  con_getc();
 putchar(ch);
 if  (ch==  '1') return(1);
 if  (ch==  '2') return(2);
@@ -657,6 +1856,13 @@ if  (ch==  '6') return(6);
 if  (ch==  '7') return(7);
 if  (ch==  '8') return(8);
 if  (ch==  '9') return(9);
+if  (ch==  'G' || ch == 'g') return(10);
+if  (ch==  'F' || ch == 'f') return(11);
+if  (ch==  'A' || ch == 'a') return(12);
+if  (ch==  'E' || ch == 'e') return(13);
+if  (ch==  'S' || ch == 's') return(14);
+if  (ch==  'X' || ch == 'x') return(15);
+if  (ch==  'R' || ch == 'r') return(16);
 return(0);
 }
 //***************************************************************************
@@ -668,10 +1874,12 @@ return(0);
 
 void load_setup_from_nvm(void)
 {
+int8 i;
 fprintf(USB, "\r\n       Reading Setup : (Size : %Ld Bytes)", sizeof(trx));
 fprintf(USB, "\r\n         Data EEPROM : (Size : %Ld Bytes)", 
 getenv("DATA_EEPROM"));
-read_eeprom_string(&buffer[0], 0, sizeof(trx));
+for (i=0; i < sizeof(trx); i++)
+       buffer[i] = read_eeprom(i);
 memcpy(&trx, &buffer[0], sizeof(trx));
 
 if (trx.setup_ok == SETUP_PRESENT)
@@ -686,8 +1894,479 @@ else   fprintf(USB, "\r\n          First Run : No Setup");
 
 void save_setup_to_nvm(void)
 {
+int8 i;
 memcpy(&buffer[0], &trx, sizeof(trx));
-write_eeprom_string(&buffer[0], 0, sizeof(trx));
+for (i=0; i < sizeof(trx); i++)
+       write_eeprom(i, buffer[i]);
+}
+//***************************************************************************
+//     DESCRIPTION:        Read recipe n from the directory into buffer
+//     RETURN:             TRUE if the slot holds a good recipe
+//     NOTES:              name gets RECIPE_NAME bytes. buffer is not used
+//                         while the loop runs so the console task can
+//                         stage a recipe there for recipe_switch().
+//***************************************************************************/
+
+BOOL recipe_load(UINT8 n, char *name)
+{
+UINT16 a;
+UINT8  i, c = 0x5A;
+
+if (n >= RECIPE_SLOTS) return(FALSE);
+a = RECIPE_EEPROM_ADDR + (UINT16)n * RECIPE_SIZE;
+if (read_eeprom(a) != RECIPE_PRESENT) return(FALSE);
+for (i=0; i < RECIPE_NAME; i++)
+       name[i] = read_eeprom(a + 1 + i);
+name[RECIPE_NAME - 1] = 0;
+for (i=0; i < sizeof(trx); i++)
+       {      buffer[i] = read_eeprom(a + RECIPE_HDR + i);
+              c ^= buffer[i];
+       }
+return(c == read_eeprom(a + RECIPE_HDR - 1));
+}
+//***************************************************************************
+//     DESCRIPTION:        Save the current setup as recipe n
+//     RETURN:             None
+//     NOTES:              The slot reads as empty until the last byte is
+//                         written, a reset part way leaves no half recipe.
+//***************************************************************************/
+
+void recipe_save(UINT8 n, char *name)
+{
+UINT16 a;
+UINT8  i, c = 0x5A;
+
+a = RECIPE_EEPROM_ADDR + (UINT16)n * RECIPE_SIZE;
+write_eeprom(a, 0xff);
+for (i=0; i < RECIPE_NAME; i++)
+       write_eeprom(a + 1 + i, name[i]);
+for (i=0; i < sizeof(trx); i++)
+       {      c ^= *((int8 *)&trx + i);
+              write_eeprom(a + RECIPE_HDR + i, *((int8 *)&trx + i));
+       }
+write_eeprom(a + RECIPE_HDR - 1, c);
+write_eeprom(a, RECIPE_PRESENT);
+}
+//***************************************************************************
+//     DESCRIPTION:        Copy the recipe in buffer to the setup
+//     RETURN:             None
+//     NOTES:              Ramp setpoint and MV belong to the running loop
+//                         and are kept.
+//***************************************************************************/
+
+void recipe_apply(void)
+{
+float rsp, mv;
+
+rsp = trx.rsp;
+mv  = trx.mv;
+memcpy(&trx, &buffer[0], sizeof(trx));
+trx.rsp = rsp;
+trx.mv  = mv;
+trx.setup_ok = SETUP_PRESENT;
+}
+//***************************************************************************
+//     DESCRIPTION:        Gain schedule table defaults
+//     RETURN:             None
+//     NOTES:              Every breakpoint gets the setup gains so the loop
+//                         behaves as before until the table is tuned.
+//***************************************************************************/
+
+void init_gain_schedule(void)
+{
+int8 i;
+for (i=0; i < GS_POINTS; i++)
+       {      gs.Kp[i] = (UINT16)(trx.Kp * (1 << GS_SHIFT));
+              gs.Ki[i] = (UINT16)(trx.Ki * (1 << GS_SHIFT));
+              gs.Kd[i] = (UINT16)(trx.Kd * (1 << GS_SHIFT));
+       }
+gs.enabled  = FALSE;
+gs.setup_ok = GS_PRESENT;
+}
+//***************************************************************************
+//     DESCRIPTION:        Calibration defaults
+//     RETURN:             None
+//     NOTES:              Safe output is 0V, trip just above full scale.
+//***************************************************************************/
+
+void init_cal_defaults(void)
+{
+cal.LV_BITS   =      12000;
+cal.HV_BITS   =      60000;
+cal.MAX_MPA   =      300 ;
+cal.TRIP_BITS =      61000;
+cal.SAFE_DAC  =      DAC_MID;
+cal.STALL_MS  =      0   ;      // Not all rigs have an encoder fitted
+cal.setup_ok  =      CAL_PRESENT;
+}
+//***************************************************************************
+//     DESCRIPTION:        Read calibration structure from NVM
+//     RETURN:             None
+//***************************************************************************/
+
+void load_cal_from_nvm(void)
+{
+int8 i;
+for (i=0; i < sizeof(cal); i++)
+       *((int8 *)&cal + i) = read_eeprom(CAL_EEPROM_ADDR + i);
+
+if (cal.setup_ok != CAL_PRESENT)
+       {      fprintf(USB, "\r\n         Calibration : None (Use Defaults)");
+              init_cal_defaults();
+              save_cal_to_nvm();
+       }
+else   fprintf(USB, "\r\n         Calibration : Ok (%Lu = %f MPa)", cal.HV_BITS, cal.MAX_MPA);
+}
+
+void save_cal_to_nvm(void)
+{
+int8 i;
+for (i=0; i < sizeof(cal); i++)
+       write_eeprom(CAL_EEPROM_ADDR + i, *((int8 *)&cal + i));
+}
+//***************************************************************************
+//     DESCRIPTION:        Read gain schedule table from NVM
+//     RETURN:             None
+//     NOTES:              Also works out the ADC to breakpoint scaling,
+//                         set_gain_scale() if cal.LV_BITS or HV_BITS change.
+//***************************************************************************/
+
+void load_gains_from_nvm(void)
+{
+int8 i;
+for (i=0; i < sizeof(gs); i++)
+       *((int8 *)&gs + i) = read_eeprom(GS_EEPROM_ADDR + i);
+
+if (gs.setup_ok != GS_PRESENT)
+       {      fprintf(USB, "\r\n       Gain Schedule : None (Using Setup Gains)");
+              init_gain_schedule();
+              save_gains_to_nvm();
+       }
+else   fprintf(USB, "\r\n       Gain Schedule : Ok (%s)", gs.enabled ? "On" : "Off");
+set_gain_scale();
+}
+
+void set_gain_scale(void)
+{
+if (cal.HV_BITS > cal.LV_BITS)
+       gs_scale = ((UINT32)(GS_POINTS-1) << 24) / (UINT16)(cal.HV_BITS - cal.LV_BITS);
+else   gs_scale = 0;
+}
+//***************************************************************************
+//     DESCRIPTION:        Write gain schedule table to NVM
+//     RETURN:             None
+//     NOTES:              Byte at a time as the table holds zero bytes
+//                         which would stop write_eeprom_string().
+//***************************************************************************/
+
+void save_gains_to_nvm(void)
+{
+int8 i;
+for (i=0; i < sizeof(gs); i++)
+       write_eeprom(GS_EEPROM_ADDR + i, *((int8 *)&gs + i));
+}
+//***************************************************************************
+//     DESCRIPTION:        Interpolate Kp, Ki and Kd for the measured ADC value
+//     RETURN:             Gains via kp, ki and kd
+//     NOTES:              Same cost every call - one 32 bit multiply gives the
+//                         breakpoint (high byte) and fraction (low byte), then
+//                         a linear blend of the two neighbouring entries.
+//***************************************************************************/
+
+void get_scheduled_gains(UINT16 adc, float *kp, float *ki, float *kd)
+{
+UINT16 pos;
+int8   n, frac;
+signed int32 k;
+
+if (!gs.enabled)
+       {      *kp = trx.Kp;  *ki = trx.Ki;  *kd = trx.Kd;
+              return;
+       }
+if (adc < cal.LV_BITS) pos = 0;
+else   pos = (UINT16)(((UINT32)(adc - cal.LV_BITS) * gs_scale) >> 16);
+if (pos >= ((GS_POINTS-1) << 8)) pos = ((GS_POINTS-2) << 8) | 0xff;
+n    = pos >> 8;
+frac = pos & 0xff;
+
+k = (signed int32)gs.Kp[n] + ((((signed int32)gs.Kp[n+1] - gs.Kp[n]) * frac) >> 8);
+*kp = (float)k / (1 << GS_SHIFT);
+k = (signed int32)gs.Ki[n] + ((((signed int32)gs.Ki[n+1] - gs.Ki[n]) * frac) >> 8);
+*ki = (float)k / (1 << GS_SHIFT);
+k = (signed int32)gs.Kd[n] + ((((signed int32)gs.Kd[n+1] - gs.Kd[n]) * frac) >> 8);
+*kd = (float)k / (1 << GS_SHIFT);
+}
+//***************************************************************************
+//     DESCRIPTION:        Operator/host entry of the gain schedule table
+//     RETURN:             None
+//     NOTES:              Lines of "point,Kp,Ki,Kd" - a host tuner can send
+//                         the whole table this way. 'E' enables, 'D'
+//                         disables and a blank line saves and exits.
+//***************************************************************************/
+
+void gain_schedule_menu(void)
+{
+INT8  *arglist[4];
+float vf0, vf1, vf2, vf3;
+char  string[40];
+int8  i, n;
+
+arglist[0] = &vf0;
+arglist[1] = &vf1;
+arglist[2] = &vf2;
+arglist[3] = &vf3;
+
+while(1)
+       {      fprintf(USB, "\r\n\n Gain Schedule (%s) - Point : MPa, Kp, Ki, Kd",
+                     gs.enabled ? "On" : "Off");
+              for (i=0; i < GS_POINTS; i++)
+                     fprintf(USB, "\r\n   %u : %03.1f, %2.3f, %2.3f, %2.3f", i,
+                     cal.MAX_MPA * i / (GS_POINTS-1),
+                     (float)gs.Kp[i] / (1 << GS_SHIFT),
+                     (float)gs.Ki[i] / (1 << GS_SHIFT),
+                     (float)gs.Kd[i] / (1 << GS_SHIFT));
+              fprintf(USB, "\r\n\n Enter point,Kp,Ki,Kd (E/D=Enable/Disable) : ");
+              get_string(string, sizeof(string));
+              if (string[0] == 0) break;
+              if (string[0] == 'E' || string[0] == 'e') { gs.enabled = TRUE;  continue; }
+              if (string[0] == 'D' || string[0] == 'd') { gs.enabled = FALSE; continue; }
+              if (sscanf(string, "%f,%f,%f,%f", arglist) != 4 || vf0 < 0 
+                  || vf0 >= GS_POINTS || vf1 < 0 || vf2 < 0 || vf3 < 0
+                  || vf1 >= 64 || vf2 >= 64 || vf3 >= 64)
+                     {      fprintf(USB, "\r\n Error : Bad entry");
+                            continue;
+                     }
+              n = (int8)vf0;
+              gs.Kp[n] = (UINT16)(vf1 * (1 << GS_SHIFT));
+              gs.Ki[n] = (UINT16)(vf2 * (1 << GS_SHIFT));
+              gs.Kd[n] = (UINT16)(vf3 * (1 << GS_SHIFT));
+       }
+save_gains_to_nvm();
+fprintf(USB, "\r\n    Saving : Gain Schedule");
+}
+//***************************************************************************
+//     DESCRIPTION:        Operator entry of the feed-forward terms
+//     RETURN:             None
+//     NOTES:              FF = Kv * d(RSP)/dt + RSP / Plant gain, added to the
+//                         PID output before the +/-5V clamp. Saved with the
+//                         setup so each test setup has its own.
+//***************************************************************************/
+
+void feed_forward_menu(void)
+{
+INT8  *arglist[4];
+float vf0;
+char  string[20];
+
+arglist[0] = &vf0;
+fprintf(USB, "\r\n\n Feed-forward is %s, Enter 1=On 0=Off : ", trx.ff_on ? "On" : "Off");
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1) trx.ff_on = (vf0 != 0);
+fprintf(USB, "\r\n  Kv (V per MPa/min) [%f] : ", trx.ff_kv);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1) trx.ff_kv = vf0;
+fprintf(USB, "\r\n  Plant gain (MPa/V, 0=None) [%f] : ", trx.ff_kpl);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 0) trx.ff_kpl = vf0;
+fprintf(USB, "\r\n (FF=%s, Kv=%f, Plant=%f)", trx.ff_on ? "On" : "Off", trx.ff_kv, trx.ff_kpl);
+}
+//***************************************************************************
+//     DESCRIPTION:        Operator entry of the estimator noise terms
+//     RETURN:             None
+//     NOTES:              Larger process noise or smaller measurement noise
+//                         gives a faster, noisier rate. Shows the gains
+//                         the loop will use.
+//***************************************************************************/
+
+void estimator_menu(void)
+{
+INT8  *arglist[4];
+float vf0;
+char  string[20];
+
+arglist[0] = &vf0;
+fprintf(USB, "\r\n\n Process noise (MPa/s^2, 0=Off) [%f] : ", trx.est_q);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 0) trx.est_q = vf0;
+fprintf(USB, "\r\n Measurement noise (MPa, 0=Off) [%f] : ", trx.est_r);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 0) trx.est_r = vf0;
+est_init();
+if (est_alpha)
+       fprintf(USB, "\r\n (Alpha=%f, Beta=%f)", est_alpha / 32767.0, est_beta / 32767.0);
+else   fprintf(USB, "\r\n (Estimator off, D from %u sample window)", R_SIZE);
+}
+//***************************************************************************
+//     DESCRIPTION:        Operator entry of the Smith predictor model
+//     RETURN:             None
+//     NOTES:              Gain, lag and dead time of the cell from a step
+//                         test. Gain 0 or dead time 0 turns it off.
+//***************************************************************************/
+
+void smith_menu(void)
+{
+INT8  *arglist[4];
+float vf0;
+char  string[20];
+
+arglist[0] = &vf0;
+fprintf(USB, "\r\n\n Model gain (MPa/V, 0=Off) [%f] : ", trx.sp_km);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1) trx.sp_km = vf0;
+fprintf(USB, "\r\n Time constant (s) [%f] : ", trx.sp_tau);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 > 0) trx.sp_tau = vf0;
+fprintf(USB, "\r\n Dead time (ms, 0=Off) [%f] : ", trx.sp_dead);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 0) trx.sp_dead = vf0;
+est_init();
+smith_init();
+if (sm_d)
+       fprintf(USB, "\r\n (Delay %u samples, max %u)", sm_d, SMITH_RING - 1);
+else   fprintf(USB, "\r\n (Smith predictor off)");
+}
+//***************************************************************************
+//     DESCRIPTION:        Open loop PRBS excitation for system identification
+//     RETURN:             None
+//     NOTES:              Output is bias +/- amplitude, the LFSR steps every
+//                         'bit' samples so the shortest pulse can be set
+//                         near the cell time constant. Each line is the ADC
+//                         sample n and the DAC code driven after it, so
+//                         the host sees the same pairing as the PID log.
+//***************************************************************************/
+
+void prbs_test(void)
+{
+INT8   *arglist[4];
+float  vf0, bias, amp;
+char   string[20];
+UINT16 lfsr, adc, bit, n, len, tick;
+
+arglist[0] = &vf0;
+if (fault.cause)
+       {      show_fault();
+              fprintf(USB, "\r\n Test not started, clear the alarm first");
+              return;
+       }
+bias = 0;  amp = 0.5;  bit = 5;  len = 1;
+fprintf(USB, "\r\n\n Bias (V) [%f] : ", bias);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 > -5 && vf0 < 5) bias = vf0;
+fprintf(USB, "\r\n Amplitude (V) [%f] : ", amp);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 > 0 && vf0 < 5) amp = vf0;
+fprintf(USB, "\r\n Samples per bit [%Lu] : ", bit);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 1 && vf0 <= 32) bit = (UINT16)vf0;
+fprintf(USB, "\r\n Sequences [%Lu] : ", len);
+get_string(string, sizeof(string));
+if (sscanf(string, "%f", arglist) == 1 && vf0 >= 1 && vf0 <= 4) len = (UINT16)vf0;
+len = len * PRBS_LENGTH * bit;         // <= 65408 samples
+
+enable_interrupts(GLOBAL);
+disable_interrupts(INT_RDA);
+setup_wdt(WDT_ON);
+init_ad7705(1);
+init_pulse_width_counter();
+enable_pulse_width_counter();
+g_enc_idle = 0;
+g_adc_same = 0;
+g_overruns = 0;
+g_adc_age = 0;
+g_adc_fresh = FALSE;
+g_dac_err = 0;
+set_dac_output(get_dac_bits16(bias));
+g_acq_on = TRUE;
+g_dither_on = TRUE;
+fprintf(USB, "\r\nPRBS start Bias:%f Amp:%f Bit:%Lu Ms:%u ..<ESC> to Exit.",
+        bias, amp, bit, CONTROL_MS);
+
+lfsr = PRBS_LENGTH;                     // Any non-zero seed
+for (n = 0; n < len && !fault.cause; n++)
+       {      while (!g_adc_fresh && !fault.cause) restart_wdt();
+              adc = adc_snapshot(&tick);
+              if (n % bit == 0)
+                     lfsr = ((lfsr << 1) | (((lfsr >> 8) ^ (lfsr >> 4)) & 1)) & PRBS_LENGTH;
+              set_dac_output(get_dac_bits16((lfsr & 1) ? bias + amp : bias - amp));
+              fprintf(USB, "\r\nPRBS,%Lu,%Lu,%Lu", n, g_dac, adc);
+              modbus_poll();                // MB_LOOP_REGS, acq is on
+              if (kbhit() && getc() == 27) break;
+       }
+set_dac_output(get_dac_bits16(bias));   // Leave the cell at the bias
+delay_ms(2);
+g_acq_on = FALSE;
+g_dither_on = FALSE;
+disable_pulse_width_counter();
+fprintf(USB, "\r\nPRBS end");
+if (fault.cause)
+       {      fault_save();
+              show_fault();
+       }
+}
+//***************************************************************************
+//     DESCRIPTION:        Operator list, save, load and delete of recipes
+//     RETURN:             None
+//     NOTES:              Load here replaces the setup while stopped, in
+//                         the loop use 'R' and the slot number instead.
+//                         With the gain table on its gains are used, not
+//                         the Kp, Ki, Kd shown here (note 21).
+//***************************************************************************/
+
+void recipe_menu(void)
+{
+INT8  *arglist[4];
+float vf0;
+char  string[20];
+char  name[RECIPE_NAME];
+struct PID *r;
+UINT8 i, n;
+
+arglist[0] = &vf0;
+r = (struct PID *)buffer;
+while(1)
+       {      fprintf(USB, "\r\n\n Recipes - Slot : Name, TSP, Rate, Kp, Ki, Kd");
+              for (i=0; i < RECIPE_SLOTS; i++)
+                     {      if (!recipe_load(i, name))
+                                   {      fprintf(USB, "\r\n   %u : (Empty)", i);
+                                          continue;
+                                   }
+                            fprintf(USB, "\r\n   %u : %s, %03.2f, %2.2f, %2.3f, %2.3f, %2.3f",
+                                    i, name, r->tsp, r->rate, r->Kp, r->Ki, r->Kd);
+                     }
+              if (gs.enabled)
+                     fprintf(USB, "\r\n Gain table is On - it sets Kp, Ki, Kd");
+              fprintf(USB, "\r\n\n Enter S n=Save setup, L n=Load, D n=Delete : ");
+              get_string(string, sizeof(string));
+              if (string[0] == 0) break;
+              if (sscanf(&string[1], "%f", arglist) != 1 || vf0 < 0 || vf0 >= RECIPE_SLOTS)
+                     {      fprintf(USB, "\r\n Error : Bad entry");
+                            continue;
+                     }
+              n = (UINT8)vf0;
+              switch(toupper(string[0]))
+                     {
+                     case 'S':
+                            memset(name, 0, sizeof(name));
+                            fprintf(USB, "\r\n Name : ");
+                            get_string(name, sizeof(name));
+                            recipe_save(n, name);
+                            break;
+                     case 'L':
+                            if (!recipe_load(n, name))
+                                   {      fprintf(USB, "\r\n Error : Slot %u empty or bad", n);
+                                          break;
+                                   }
+                            recipe_apply();
+                            save_setup_to_nvm();
+                            fprintf(USB, "\r\n    Loaded : %s", name);
+                            break;
+                     case 'D':
+                            write_eeprom(RECIPE_EEPROM_ADDR + (UINT16)n * RECIPE_SIZE, 0xff);
+                            break;
+                     default:
+                            fprintf(USB, "\r\n Error : Bad entry");
+                     }
+       }
 }
 //***************************************************************************
 //     DESCRIPTION:        Converts string pointed to by s to a float
@@ -702,6 +2381,9 @@ trx.Kp     = 0;  trx.Ki  = 0;  trx.Kd   = 0;
 trx.rate   = 0;  trx.rsp = 0;  trx.tsp  = 0;
 trx.tsp    = 0;  trx.mv  = 0;  trx.pb   = 0;
 trx.mverr  = 0;  trx.setup_ok = 0;
+trx.ff_kv  = 0;  trx.ff_kpl = 0; trx.ff_on = 0;
+trx.est_q  = 0;  trx.est_r  = 0;
+trx.sp_km  = 0;  trx.sp_tau = 0; trx.sp_dead = 0;
 strcpy(trx.fwd, "\0");
 }
 //***************************************************************************
@@ -733,6 +2415,421 @@ void check_erased(void)
      	}
 }
 //***************************************************************************
+//     DESCRIPTION:        Trip the loop - called from tick_isr()
+//     RETURN:             None
+//     NOTES:              Safe output goes out first, the first cause is
+//                         kept until the operator clears it.
+//***************************************************************************/
+
+void fault_latch(UINT8 cause, UINT16 adc)
+{
+dac_transfer(cal.SAFE_DAC);
+if (fault.cause) return;
+fault.cause = cause;
+fault.ticks = g_ticks;
+fault.adc   = adc;
+fault.magic = FAULT_MAGIC;
+fault.check = fault_check();
+g_fault_seq++;
+}
+//***************************************************************************
+//     DESCRIPTION:        Write a latched fault record to EEPROM
+//     RETURN:             None
+//     NOTES:              From a snapshot, the loop may still be running.
+//***************************************************************************/
+
+void fault_save(void)
+{
+struct FAULT f;
+int8 i;
+fault_snapshot(&f);
+for (i=0; i < sizeof(f); i++)
+       write_eeprom(FAULT_EEPROM_ADDR + i, *((int8 *)&f + i));
+}
+
+UINT8 fault_check(void)
+{
+UINT8 i, c = 0x5A;
+for (i=0; i < sizeof(fault) - 1; i++)
+       c ^= *((int8 *)&fault + i);
+return(c);
+}
+//***************************************************************************
+//     DESCRIPTION:        Find a latched fault after a restart
+//     RETURN:             None
+//     NOTES:              RAM copy is good after a WDT restart even if the
+//                         loop never got to save it, otherwise use EEPROM.
+//***************************************************************************/
+
+void check_fault_latch(void)
+{
+int8 i;
+if (fault.magic != FAULT_MAGIC || fault.check != fault_check())
+       {      for (i=0; i < sizeof(fault); i++)
+                     *((int8 *)&fault + i) = read_eeprom(FAULT_EEPROM_ADDR + i);
+              if (fault.magic != FAULT_MAGIC || fault.check != fault_check())
+                     fault.cause = FAULT_NONE;
+       }
+if (fault.cause)
+       {      disable_interrupts(INT_TIMER2);      // tick_isr() owns the DAC
+              dac_transfer(cal.SAFE_DAC);
+              enable_interrupts(INT_TIMER2);
+              show_fault();
+       }
+}
+
+void show_fault(void)
+{
+struct FAULT f;
+fault_snapshot(&f);
+fprintf(USB, "\r\n    Alarm : ");
+switch(f.cause)
+       {
+       case FAULT_NONE:       fprintf(USB, "None");               return;
+       case FAULT_OVER_MPA:   fprintf(USB, "Over pressure");      break;
+       case FAULT_UNDER_MPA:  fprintf(USB, "Sensor open/low");    break;
+       case FAULT_ADC_SAT:    fprintf(USB, "ADC saturated");      break;
+       case FAULT_ADC_STUCK:  fprintf(USB, "ADC stuck");          break;
+       case FAULT_ENC_STALL:  fprintf(USB, "Encoder stall");      break;
+       case FAULT_OVERRUN:    fprintf(USB, "Loop overrun");       break;
+       case FAULT_ADC_TIMEOUT:fprintf(USB, "ADC not converting"); break;
+       default:               fprintf(USB, "Unknown (%u)", f.cause); break;
+       }
+fprintf(USB, " at %Lu ms, ADC : %Lu", f.ticks, f.adc);
+}
+
+void clear_fault(void)
+{
+int8 i;
+fault.cause = FAULT_NONE;
+fault.magic = 0;
+fault.check = fault_check();
+for (i=0; i < sizeof(fault); i++)
+       write_eeprom(FAULT_EEPROM_ADDR + i, *((int8 *)&fault + i));
+fprintf(USB, "\r\n    Alarm : Cleared");
+}
+//***************************************************************************
+//     DESCRIPTION:        Output command from the control loop
+//     RETURN:             None
+//     NOTES:              dac is the 16 bit command from get_dac_bits16(),
+//                         tick_isr() dithers it onto the DAC. Holds the safe
+//                         output while a fault is latched.
+//***************************************************************************/
+
+void set_dac_output(UINT16 dac)
+{
+disable_interrupts(INT_TIMER2);
+if (fault.cause) dac = cal.SAFE_DAC << 4;   // Checked under the mask
+g_dac_cmd = dac;
+g_dac = dac >> 4;
+enable_interrupts(INT_TIMER2);
+}
+//***************************************************************************
+//     DESCRIPTION:        Volts to a 16 bit output command
+//     RETURN:             0 to DAC16_MAX, top 12 bits are the DAC code
+//     NOTES:              Same scaling as get_dac_bits() with 4 more bits.
+//***************************************************************************/
+
+UINT16 get_dac_bits16(float volts)
+{
+float bits;
+bits = (volts + 5) * (DAC16_MAX / 10.0);
+if (bits < 0)         return(0);
+if (bits > DAC16_MAX) return(DAC16_MAX);
+return((UINT16)bits);
+}
+//***************************************************************************
+//     DESCRIPTION:        Write of a 12 bit code to the AD7243
+//     RETURN:             None
+//     NOTES:              SYNC low frames the 16 bit word and its rising edge
+//                         loads the DAC. With DAC_READBACK SDO shifts back
+//                         the word the previous write loaded while this one
+//                         goes out, so one write per code is checked. On a
+//                         mismatch the DAC held a corrupt code, it is
+//                         counted and this code written again (that echo
+//                         is of this code, so is checked at once).
+//***************************************************************************/
+
+void dac_transfer(UINT16 code)
+{
+#if DAC_READBACK
+UINT16 echo;
+#endif
+
+code &= 0xfff;
+output_low(AD7243_CS);
+#if DAC_READBACK
+echo = spi_xfer(SPI, code, 16);
+#else
+spi_xfer(SPI, code, 16);
+#endif
+output_high(AD7243_CS);
+#if DAC_READBACK
+if (g_dac_known && (echo & 0xfff) != g_dac_last)
+       {      g_dac_errors++;
+              output_low(AD7243_CS);
+              echo = spi_xfer(SPI, code, 16);
+              output_high(AD7243_CS);
+              if ((echo & 0xfff) != code) g_dac_errors++;
+       }
+g_dac_last  = code;
+g_dac_known = TRUE;
+#endif
+}
+//***************************************************************************
+//     DESCRIPTION:        Readback error count written by tick_isr()
+//     RETURN:             g_dac_errors
+//     NOTES:              Only counts up, two equal reads are not torn.
+//***************************************************************************/
+
+UINT16 get_dac_errors(void)
+{
+UINT16 n;
+
+do     n = g_dac_errors;
+while (n != g_dac_errors);
+return(n);
+}
+//***************************************************************************
+//     DESCRIPTION:        Modbus register map and receive interrupt
+//     RETURN:             None
+//     NOTES:              Holding 0x000 trx, 0x100 gain table
+//                         Input   0x000 loop, 0x100 cal, 0x200 fault
+//                         (a fault_snapshot() taken for each request),
+//                         0x300 DAC readback errors, frames, frame errors
+//                         Each register is two bytes of the structure in
+//                         memory order (low byte first), so a float is two
+//                         registers low word first in CCS float format.
+//                         Writable maps round down so an odd sized
+//                         structure can not be written past its end.
+//***************************************************************************/
+
+void modbus_init(void)
+{
+mb_map[0].table = MB_HOLDING; mb_map[0].base = 0x000;
+mb_map[0].words = sizeof(trx) / 2;        mb_map[0].data = &trx;
+mb_map[1].table = MB_HOLDING; mb_map[1].base = 0x100;
+mb_map[1].words = sizeof(gs) / 2;         mb_map[1].data = &gs;
+mb_map[2].table = MB_INPUT;   mb_map[2].base = 0x000;
+mb_map[2].words = (sizeof(loop) + 1) / 2; mb_map[2].data = &loop;
+mb_map[3].table = MB_INPUT;   mb_map[3].base = 0x100;
+mb_map[3].words = (sizeof(cal) + 1) / 2;  mb_map[3].data = &cal;
+mb_map[4].table = MB_INPUT;   mb_map[4].base = 0x200;
+mb_map[4].words = (sizeof(fault) + 1) / 2; mb_map[4].data = &mb_fault;
+mb_map[5].table = MB_INPUT;   mb_map[5].base = 0x300;
+mb_map[5].words = sizeof(mb_diag) / 2;    mb_map[5].data = mb_diag;
+
+mb_len = 0;
+mb_ready = FALSE;
+mb_over = FALSE;
+setup_timer_3(T3_INTERNAL | T3_DIV_BY_1);
+disable_interrupts(INT_TIMER3);
+ext_int_edge(H_TO_L);           // Start bit
+clear_interrupt(INT_EXT);
+enable_interrupts(INT_EXT);
+}
+
+UINT16 modbus_crc(UINT16 crc, UINT8 c)
+{
+UINT8 i;
+crc ^= c;
+for (i=0; i < 8; i++)
+       {      if (crc & 1) crc = (crc >> 1) ^ 0xA001;
+              else         crc >>= 1;
+       }
+return(crc);
+}
+//***************************************************************************
+//     DESCRIPTION:        Handle a received Modbus frame
+//     RETURN:             None
+//     NOTES:              Called from the main loops. Only whole registers
+//                         inside one structure can be read or written.
+//                         Broadcast (address 0) writes are not answered.
+//                         A frame too long for mb_buf can not have its CRC
+//                         checked, it gets exception 3 so the master does
+//                         not wait out its timeout.
+//***************************************************************************/
+
+void modbus_poll(void)
+{
+UINT8  fc, table, i, n, m;
+UINT16 reg, count, off, crc;
+int8   *p;
+
+if (!mb_ready) return;
+mb_frames++;
+if (mb_age >= MB_STALE_MS)             // Master has timed out, a late
+       {      mb_errors++;             // reply would hit its next request
+              mb_len = 0;
+              mb_over = FALSE;
+              mb_ready = FALSE;
+              return;
+       }
+if (mb_over && mb_buf[0] == MB_ADDRESS)
+       {      mb_errors++;
+              modbus_exception(3);
+              return;
+       }
+for (i=0, crc=0xffff; i < mb_len; i++) crc = modbus_crc(crc, mb_buf[i]);
+if (mb_len < 8 || crc != 0 || (mb_buf[0] != MB_ADDRESS && mb_buf[0] != 0))
+       {      if (crc != 0) mb_errors++;      // Not for us is not an error
+              mb_len = 0;
+              mb_over = FALSE;
+              mb_ready = FALSE;
+              return;
+       }
+fc    = mb_buf[1];
+reg   = make16(mb_buf[2], mb_buf[3]);
+count = make16(mb_buf[4], mb_buf[5]);
+if (fc == 6) count = 1;
+table = (fc == 4) ? MB_INPUT : MB_HOLDING;
+if (fc != 3 && fc != 4 && fc != 6 && fc != 16)
+       {      modbus_exception(1);
+              return;
+       }
+if (count == 0 || count > (g_acq_on ? MB_LOOP_REGS : MB_MAX_REGS)
+    || (fc == 16 && (mb_buf[6] != count * 2 || mb_len < 9 + count * 2)))
+       {      modbus_exception(3);
+              return;
+       }
+for (m=0; m < MB_MAPS; m++)
+       if (mb_map[m].table == table && reg >= mb_map[m].base
+           && reg + count <= mb_map[m].base + mb_map[m].words)
+              break;
+if (m == MB_MAPS)
+       {      modbus_exception(2);
+              return;
+       }
+if (mb_map[m].data == (int8 *)&mb_fault) fault_snapshot(&mb_fault);
+if (mb_map[m].data == (int8 *)mb_diag)
+       {      mb_diag[0] = get_dac_errors();
+              mb_diag[1] = mb_frames;
+              mb_diag[2] = mb_errors;
+       }
+off = (reg - mb_map[m].base) * 2;
+p   = mb_map[m].data + off;
+n   = count * 2;
+
+if (fc == 3 || fc == 4)
+       {      mb_buf[2] = n;
+              for (i=0; i < n; i += 2)
+                     {      mb_buf[3+i] = p[i+1];
+                            mb_buf[4+i] = p[i];
+                     }
+              modbus_send(3 + n);
+              return;
+       }
+memcpy(mb_undo, mb_map[m].data, mb_map[m].words * 2);
+if (fc == 6)
+       {      p[1] = mb_buf[4];
+              p[0] = mb_buf[5];
+       }
+else   for (i=0; i < n; i += 2)        // fc 16
+              {      p[i+1] = mb_buf[7+i];
+                     p[i]   = mb_buf[8+i];
+              }
+if (mb_map[m].data == (int8 *)&trx ? !setup_valid() : !gains_valid())
+       {      memcpy(mb_map[m].data, mb_undo, mb_map[m].words * 2);
+              modbus_exception(3);
+              return;
+       }
+modbus_send(6);                          // Echo (fc 6) or reg and count
+if (mb_map[m].data == (int8 *)&trx) modbus_setup_changed();
+else   {      set_gain_scale();
+              if (g_kernel_on) g_save_gains = TRUE;
+              else   save_gains_to_nvm();
+       }
+}
+//***************************************************************************
+//     DESCRIPTION:        Check trx after a Modbus write
+//     RETURN:             TRUE if every field is in range
+//     NOTES:              Written so a NaN fails (every compare with it is
+//                         false). pb is divided by in get_dac_volts().
+//***************************************************************************/
+
+BOOL setup_valid(void)
+{
+if (!(trx.Kp >= 0 && trx.Kp < 1000 && trx.Ki >= 0 && trx.Ki < 1000
+      && trx.Kd >= 0 && trx.Kd < 1000))                   return(FALSE);
+if (!(trx.pb > 0 && trx.pb <= cal.MAX_MPA))                return(FALSE);
+if (!(trx.rate >= 0 && trx.rate < 1e6))                    return(FALSE);
+if (!(trx.tsp >= 0 && trx.tsp <= cal.MAX_MPA))             return(FALSE);
+if (!(trx.rsp >= 0 && trx.rsp <= cal.MAX_MPA))             return(FALSE);
+if (!(trx.ff_kv > -1000 && trx.ff_kv < 1000))              return(FALSE);
+if (!(trx.ff_kpl >= 0 && trx.ff_kpl < 1e6))                return(FALSE);
+if (trx.ff_on > 1)                                         return(FALSE);
+if (!(trx.est_q >= 0 && trx.est_q < 1e6 && trx.est_r >= 0 && trx.est_r < 1e6))
+                                                           return(FALSE);
+if (!(trx.sp_km > -1e6 && trx.sp_km < 1e6))                return(FALSE);
+if (!(trx.sp_tau >= 0 && trx.sp_tau < 1e4))                return(FALSE);
+if (!(trx.sp_dead >= 0 && trx.sp_dead <= CONTROL_MS * (SMITH_RING - 1.0)))
+                                                           return(FALSE);
+return(trx.setup_ok == 0x62);
+}
+//***************************************************************************
+//     DESCRIPTION:        Check gs after a Modbus write
+//     RETURN:             TRUE if it can be used
+//     NOTES:              Any Q6.10 value is a gain of 0 to 63.99.
+//***************************************************************************/
+
+BOOL gains_valid(void)
+{
+return(gs.enabled <= 1 && gs.setup_ok == 0x47);
+}
+//***************************************************************************
+//     DESCRIPTION:        Act on a Modbus write to trx
+//     RETURN:             None
+//     NOTES:              mb_undo holds trx as it was. The estimator and
+//                         Smith model restart as in recipe_switch() when
+//                         their terms changed. In the loop the save is
+//                         left to task_persist().
+//***************************************************************************/
+
+void modbus_setup_changed(void)
+{
+struct PID *u;
+
+u = (struct PID *)mb_undo;
+if (u->est_q != trx.est_q || u->est_r != trx.est_r) est_init();
+if (u->sp_km != trx.sp_km || u->sp_tau != trx.sp_tau || u->sp_dead != trx.sp_dead)
+       {      smith_init();
+              loop.smith = 0;
+              ctl_smith_last = 0;
+              ctl_mvfb = loop.mv;
+       }
+if (g_kernel_on) g_save_setup = TRUE;
+else   save_setup_to_nvm();
+}
+
+void modbus_exception(UINT8 code)
+{
+mb_buf[1] |= 0x80;
+mb_buf[2] = code;
+modbus_send(3);
+}
+//***************************************************************************
+//     DESCRIPTION:        Send mb_buf with its CRC and free the buffer
+//     RETURN:             None
+//***************************************************************************/
+
+void modbus_send(UINT8 n)
+{
+UINT8  i;
+UINT16 crc = 0xffff;
+
+if (mb_buf[0] != 0)
+       {      for (i=0; i < n; i++)
+                     {      crc = modbus_crc(crc, mb_buf[i]);
+                            fputc(mb_buf[i], USB1);
+                     }
+              fputc(make8(crc, 0), USB1);
+              fputc(make8(crc, 1), USB1);
+       }
+mb_len = 0;
+mb_over = FALSE;
+mb_ready = FALSE;
+}
+//***************************************************************************
 //     DESCRIPTION:        Converts string pointed to by s to a float
 //     RETURN:             None
 //     NOTES:              Process Restart Cause
@@ -764,7 +2861,7 @@ void 	get_string(char* s, int max)
 
 	--max;
 	len=0;
-	do     	{	c=getc();
+	do     	{	c=con_getc();
 			if(c==8)     
 				{ // Backspace
 				if(len>0)     
@@ -794,12 +2891,41 @@ char 	timed_getc(long       value)
 
 	if (value < 0) value = 5000;
 	while ( !kbhit() && ( ++timeout < value ) ) 
-	delay_us(10);
+	{	modbus_poll();
+		delay_us(10);
+	}
 
 if (kbhit()) 	return(getc());
 else           	return(0);
 }
 //***************************************************************************
+//     DESCRIPTION:        Wait for a console character
+//     RETURN:             Character
+//     NOTES:              The Modbus slave is answered while the operator
+//                         is in the menus.
+//***************************************************************************
+
+char con_getc(void)
+{
+while (!kbhit())
+       {      modbus_poll();
+              restart_wdt();
+       }
+return(getc());
+}
+//***************************************************************************
+//     DESCRIPTION:        delay_ms() that keeps the Modbus slave answering
+//     RETURN:             None
+//***************************************************************************
+
+void wait_ms(UINT16 ms)
+{
+while (ms--)
+       {      modbus_poll();
+              delay_ms(1);
+       }
+}
+//***************************************************************************
 //     DESCRIPTION:        Converts string pointed to by s to a float
 //     RETURN:             None
 //***************************************************************************
@@ -904,29 +3030,29 @@ output_high(AD7705_CS);
 output_high(ADC_RESET);
 
 fprintf(USB, "\r\n");
-delay_ms(1000);        
+wait_ms(1000);        
 fprintf(USB, "\r...Initialising AD7705 ADC:  (3 Seconds)");
-delay_ms(1000);        
+wait_ms(1000);        
 fprintf(USB, "\r...Initialising AD7705 ADC:  (2 Seconds)");
-delay_ms(1000);        
+wait_ms(1000);        
 fprintf(USB, "\r...Initialising AD7705 ADC:  (1 Second)  ");
 if (type)
         {
         read_adc_value(0); 
         setup_ad7705(ADC_NORMAL,         ADC_GAIN_1,   0x4, ADC_50,  0x2,  0x0);
-        delay_ms(100); 
+        wait_ms(100); 
         setup_ad7705(ADC_ZERO_SCALE,     ADC_GAIN_1,   0x4, ADC_50,  0x2,  0x1);
-        delay_ms(100);
+        wait_ms(100);
         setup_ad7705(ADC_NORMAL,         ADC_GAIN_1,   0x4, ADC_50,  0x0,  0x0);
-        delay_ms(100); 
+        wait_ms(100); 
         fprintf(USB, "\r\n\n "); 
         read_adc_value(1); 
         setup_ad7705(ADC_NORMAL,         ADC_GAIN_1,   0x4, ADC_50,  0x2,  0x0);
-        delay_ms(100);
+        wait_ms(100);
         setup_ad7705(ADC_ZERO_SCALE,     ADC_GAIN_1,   0x4, ADC_50,  0x2,  0x1);
-        delay_ms(100);
+        wait_ms(100);
         setup_ad7705(ADC_NORMAL,         ADC_GAIN_1,   0x4, ADC_50,  0x0,  0x0);
-        delay_ms(100);
+        wait_ms(100);
         //     read_adc_value(1);
         }      setup_wdt(WDT_ON);
 }
@@ -1013,4 +3139,6 @@ long int read_adc_word()
             		output_high(ADC_CLK);
             		shift_left(&data,2, input(ADC_D0));
             	}
+         output_high(AD7705_CS);
+         return(data);
 }
@@ -0,0 +1,646 @@
+//*******************************************************************
+//   Program:    fleet_sim.c
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Steps a whole fleet of triaxial cells (PID state + hydraulic plant)
+// together so a firmware change can be checked against thousands of
+// plant variants in one run. State is held as structure of arrays and
+// stepped 8 cells at a time with AVX2, 4 at a time with SSE2 or one at
+// a time with the scalar fallback. Blocks of cells are shared out
+// across threads and the run reports cell-steps per second.
+//
+//   Build:  gcc -O2 -mavx2 -pthread -o fleet_sim fleet_sim.c -lm
+//           (or -msse2 / no flag for the SSE2 or scalar kernels)
+//   Usage:  fleet_sim [-n cells] [-s steps] [-t threads] [-o file.csv]
+//                     [-kp Kp] [-ki Ki] [-kd Kd] [-sp TSP] [-pb PB]
+//                     [-scalar] [-check] [-dead ms]
+//                     [-smith Km tau dead_ms] [-estq q -estr r]
+//                     [-ffkv Kv] [-ffkpl Kpl] [-rate KPa/min] [-gs file]
+//
+// Note 1: The control law is pid_law.h (the host copy of run_pid()).
+//         -check re-runs every cell through pid_law_step() after the
+//         fleet has finished, compares the final plant pressure and
+//         counts (and exits 1 on) the cells that differ. Only the first
+//         is printed.
+// Note 2: Plant is a servo valve into a leaky volume, pressure rate is
+//         proportional to volts less a leak proportional to pressure.
+//         Valve gain and leak are spread over the fleet from the cell
+//         number so runs are repeatable.
+// Note 3: Do not build with -mfma/-march=native, contracted multiplies
+//         make the SIMD results differ from pid_law_step() in the LSB.
+// Note 4: -dead gives the plant a transport delay (DAC codes held in a
+//         per cell ring). -dead and -smith run every cell through
+//         pid_law_step() (the "law" kernel) as the SIMD kernels only
+//         have the windowed or estimator D law. -smith sets the
+//         predictor model as the setup would (gain MPa/V, lag s, dead
+//         time ms).
+// Note 5: Feed forward (-ffkv/-ffkpl), a setpoint ramp from 0 (-rate)
+//         and a gain table (-gs, the "n,Kp,Ki,Kd" lines sysid prints)
+//         also select the law kernel. The SIMD and scalar kernels are
+//         only used for the plain law. The law kernel is pid_law_step()
+//         itself so -check has nothing to compare it with and is
+//         skipped - these modes are not checked.
+// Note 6: The estimator is on by default with the init_setup_defaults()
+//         noise terms (-estq 5 -estr 0.05), -estq 0 gives the windowed
+//         D. Its fixed point update is in every kernel - 32 bit lanes,
+//         the 16x16 products as mullo (emulated on SSE2).
+//*******************************************************************
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define    LANES            8
+#define    KERNEL_NAME      "AVX2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define    LANES            4
+#define    KERNEL_NAME      "SSE2"
+#else
+#define    LANES            1
+#define    KERNEL_NAME      "scalar"
+#endif
+
+#include "pid_law.h"
+
+#define    BLOCK            256      // Cells per work item (fits in L1)
+#define    STEP_MS          20       // AD7705 at 50Hz
+#define    ADC_FULL         65535.0f
+#define    DEAD_MAX         (SMITH_RING * STEP_MS)
+
+struct FLEET
+{    size_t n             ;    // Cells (rounded up to a whole block)
+     size_t used          ;    // Cells asked for
+     float *integ[R_SIZE] ;    // Error FIFO per cell
+     float *mvstart       ;
+     float *mvnew         ;
+     float *D             ;
+     float *p             ;    // Plant pressure in MPa
+     float *kq            ;    // Valve gain MPa/V per step
+     float *kl            ;    // Leak per step
+     float *pmax          ;    // Peak pressure seen
+     int32_t *ex, *ev     ;    // Estimate and rate, ADC counts Q8
+     struct pid_law_cfg cfg;
+     struct pid_law_state *st;  // Per cell law state (law kernel)
+     uint16_t *ring       ;    // Per cell DAC codes in transit
+     unsigned dead        ;    // Plant dead time in steps
+     int law              ;    // Use the law kernel
+     float rate           ;    // Setpoint ramp KPa/min (0 = step)
+     struct pid_law_gs gs ;    // Gain table (law kernel)
+     unsigned steps       ;
+     int scalar           ;    // Force the scalar kernel
+     int check            ;    // Cross check against pid_law_step()
+     size_t next          ;    // Next block to hand out
+     long mismatches      ;
+}    fleet ;
+
+static float *alloc_lane(size_t n)
+{
+float *p = aligned_alloc(32, n * sizeof(float));
+
+if (!p) { fprintf(stderr, "fleet_sim: out of memory\n"); exit(1); }
+memset(p, 0, n * sizeof(float));
+return(p);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Spread the plant variants over the fleet
+//     RETURN:             None
+//     NOTES:              Simple integer hash so every run is the same.
+//***************************************************************************
+static void init_fleet(size_t cells)
+{
+size_t i;
+int j;
+
+fleet.used = cells;
+fleet.n = (cells + BLOCK - 1) / BLOCK * BLOCK;
+for (j = 0; j < R_SIZE; j++) fleet.integ[j] = alloc_lane(fleet.n);
+fleet.mvstart = alloc_lane(fleet.n);
+fleet.mvnew   = alloc_lane(fleet.n);
+fleet.D       = alloc_lane(fleet.n);
+fleet.p       = alloc_lane(fleet.n);
+fleet.ex      = (int32_t *)alloc_lane(fleet.n);
+fleet.ev      = (int32_t *)alloc_lane(fleet.n);
+if (fleet.law)
+       {      fleet.st = calloc(fleet.n, sizeof(*fleet.st));
+              if (!fleet.st) { fprintf(stderr, "fleet_sim: out of memory\n"); exit(1); }
+              for (i = 0; i < fleet.n; i++) pid_law_init(&fleet.st[i], 0);
+       }
+if (fleet.dead)
+       {      fleet.ring = malloc(fleet.n * fleet.dead * sizeof(*fleet.ring));
+              if (!fleet.ring) { fprintf(stderr, "fleet_sim: out of memory\n"); exit(1); }
+              for (i = 0; i < fleet.n * fleet.dead; i++) fleet.ring[i] = pid_law_dac_bits(0);
+       }
+fleet.kq      = alloc_lane(fleet.n);
+fleet.kl      = alloc_lane(fleet.n);
+fleet.pmax    = alloc_lane(fleet.n);
+
+for (i = 0; i < fleet.n; i++)
+       {      unsigned h = (unsigned)i * 2654435761u;
+              fleet.kq[i] = 0.20f + 0.80f * (float)((h >> 8)  & 0xff) / 255.0f;
+              fleet.kl[i] = 0.001f + 0.004f * (float)((h >> 16) & 0xff) / 255.0f;
+       }
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Plant pressure to a 16 bit AD7705 reading
+//     RETURN:             ADC bits
+//***************************************************************************
+static inline float plant_adc(const struct pid_law_cfg *c, float p)
+{
+float a = c->lv_bits + p * (c->hv_bits - c->lv_bits) / c->max_mpa;
+
+if (a < 0)        a = 0;
+if (a > ADC_FULL) a = ADC_FULL;
+return((float)(uint16_t)a);
+}
+
+static inline float plant_step(float p, float kq, float kl, float va)
+{
+p = p + kq * va - kl * p;
+return(p < 0 ? 0 : p);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Transport delay between the DAC and the plant
+//     RETURN:             DAC code written fleet.dead steps ago
+//***************************************************************************
+static inline uint16_t plant_delay(uint16_t *ring, unsigned k, uint16_t dac)
+{
+uint16_t *slot, out;
+
+if (!fleet.dead) return(dac);
+slot  = &ring[k % fleet.dead];
+out   = *slot;
+*slot = dac;
+return(out);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Setup for pass k of one cell
+//     RETURN:             None
+//     NOTES:              Ramped setpoint and scheduled gains as
+//                         task_control() would have them on that pass.
+//***************************************************************************
+static void pass_cfg(struct pid_law_cfg *c, unsigned k, uint16_t adc)
+{
+float sp;
+
+*c = fleet.cfg;
+if (fleet.rate > 0)
+       {      sp = fleet.rate * (k + 1) * STEP_MS / (1000 * 60000.0f);
+              if (sp < c->tsp) c->tsp = sp;
+       }
+pid_law_schedule(c, &fleet.gs, adc);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        One control period for cells lo..hi through
+//                         pid_law_step() (estimator / Smith / dead time,
+//                         feed forward, ramp and gain table)
+//     RETURN:             None
+//***************************************************************************
+static void step_law(size_t lo, size_t hi, unsigned k)
+{
+struct pid_law_cfg c;
+size_t i;
+
+for (i = lo; i < hi; i++)
+       {      uint16_t adc = (uint16_t)plant_adc(&fleet.cfg, fleet.p[i]), dac;
+
+              pass_cfg(&c, k, adc);
+              dac = pid_law_step(&c, &fleet.st[i], adc);
+
+              dac = plant_delay(fleet.ring + i * fleet.dead, k, dac);
+              fleet.p[i] = plant_step(fleet.p[i], fleet.kq[i], fleet.kl[i],
+                                      pid_law_dac_to_volts(dac));
+              if (fleet.p[i] > fleet.pmax[i]) fleet.pmax[i] = fleet.p[i];
+       }
+}
+
+//***************************************************************************
+//     DESCRIPTION:        One control period for cells lo..hi, scalar
+//     RETURN:             None
+//     NOTES:              Same order of operations as pid_law_step(). k 0
+//                         primes the estimator as the first pass does.
+//***************************************************************************
+static void step_scalar(size_t lo, size_t hi, unsigned count, unsigned k)
+{
+const struct pid_law_cfg *c = &fleet.cfg;
+float *integ = fleet.integ[count];
+size_t i;
+
+for (i = lo; i < hi; i++)
+       {      float adc, mv, I, P, volts;
+              uint16_t dac;
+
+              if (count == 0) fleet.mvstart[i] = fleet.mvnew[i];
+              adc = plant_adc(c, fleet.p[i]);
+              mv  = (adc - c->lv_bits) * c->max_mpa / (c->hv_bits - c->lv_bits);
+              fleet.mvnew[i] = mv;
+              if (c->est_alpha)
+                     {      int32_t z = (int32_t)adc << 8, xp, r;
+
+                            if (k == 0) fleet.ex[i] = z, fleet.ev[i] = 0;
+                            else   {      xp = fleet.ex[i] + fleet.ev[i];
+                                          r  = (z - xp) >> 4;
+                                          if (r > 32767)  r = 32767;
+                                          if (r < -32767) r = -32767;
+                                          fleet.ex[i] = xp + ((r * c->est_alpha) >> 11);
+                                          fleet.ev[i] += (r * c->est_beta) >> 11;
+                                   }
+                            fleet.D[i] = -((float)fleet.ev[i] * c->est_scale);
+                     }
+              else if (count == 0) fleet.D[i] = (fleet.mvstart[i] - mv) / R_SIZE;
+              integ[i] = c->tsp - mv;
+              I = (fleet.integ[0][i]+fleet.integ[1][i]+fleet.integ[2][i]
+                  +fleet.integ[3][i]+fleet.integ[4][i]) / (R_SIZE * c->max_mpa);
+              P = pid_law_dac_volts(mv, c->tsp, c->pb);
+              if (P != 5 && P != -5)
+                     {      volts = (c->Kp*P) + (c->Ki*I) + (c->Kd*fleet.D[i]);
+                            if (volts >  5) volts = +5;
+                            if (volts < -5) volts = -5;
+                     }
+              else   volts = c->Kp * P;
+              if (volts > 5) volts = 5;
+              dac = pid_law_dac_bits(volts);
+              fleet.p[i] = plant_step(fleet.p[i], fleet.kq[i], fleet.kl[i],
+                                      pid_law_dac_to_volts(dac));
+              if (fleet.p[i] > fleet.pmax[i]) fleet.pmax[i] = fleet.p[i];
+       }
+}
+
+#if LANES > 1
+#if LANES == 8
+typedef __m256 VF;
+#define    VSET(x)          _mm256_set1_ps(x)
+#define    VLD(p)           _mm256_load_ps(p)
+#define    VST(p, v)        _mm256_store_ps(p, v)
+#define    VADD             _mm256_add_ps
+#define    VSUB             _mm256_sub_ps
+#define    VMUL             _mm256_mul_ps
+#define    VDIV             _mm256_div_ps
+#define    VMIN             _mm256_min_ps
+#define    VMAX             _mm256_max_ps
+#define    VGE(a, b)        _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define    VLE(a, b)        _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define    VNE(a, b)        _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#define    VAND             _mm256_and_ps
+#define    VSEL(m, a, b)    _mm256_blendv_ps(b, a, m)
+#define    VTRUNC(v)        _mm256_cvtepi32_ps(_mm256_cvttps_epi32(v))
+#define    VNEG(v)          _mm256_xor_ps(v, _mm256_set1_ps(-0.0f))
+typedef __m256i VI;
+#define    ISET(x)          _mm256_set1_epi32(x)
+#define    ILD(p)           _mm256_load_si256((const __m256i *)(p))
+#define    IST(p, v)        _mm256_store_si256((__m256i *)(p), v)
+#define    IADD             _mm256_add_epi32
+#define    ISUB             _mm256_sub_epi32
+#define    ISRA             _mm256_srai_epi32
+#define    ISLL             _mm256_slli_epi32
+#define    IMUL             _mm256_mullo_epi32
+#define    IMIN             _mm256_min_epi32
+#define    IMAX             _mm256_max_epi32
+#define    ICVT(v)          _mm256_cvttps_epi32(v)
+#define    IFLT(v)          _mm256_cvtepi32_ps(v)
+#else
+typedef __m128 VF;
+#define    VSET(x)          _mm_set1_ps(x)
+#define    VLD(p)           _mm_load_ps(p)
+#define    VST(p, v)        _mm_store_ps(p, v)
+#define    VADD             _mm_add_ps
+#define    VSUB             _mm_sub_ps
+#define    VMUL             _mm_mul_ps
+#define    VDIV             _mm_div_ps
+#define    VMIN             _mm_min_ps
+#define    VMAX             _mm_max_ps
+#define    VGE(a, b)        _mm_cmpge_ps(a, b)
+#define    VLE(a, b)        _mm_cmple_ps(a, b)
+#define    VNE(a, b)        _mm_cmpneq_ps(a, b)
+#define    VAND             _mm_and_ps
+#define    VSEL(m, a, b)    _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define    VTRUNC(v)        _mm_cvtepi32_ps(_mm_cvttps_epi32(v))
+#define    VNEG(v)          _mm_xor_ps(v, _mm_set1_ps(-0.0f))
+typedef __m128i VI;
+#define    ISET(x)          _mm_set1_epi32(x)
+#define    ILD(p)           _mm_load_si128((const __m128i *)(p))
+#define    IST(p, v)        _mm_store_si128((__m128i *)(p), v)
+#define    IADD             _mm_add_epi32
+#define    ISUB             _mm_sub_epi32
+#define    ISRA             _mm_srai_epi32
+#define    ISLL             _mm_slli_epi32
+#define    ICVT(v)          _mm_cvttps_epi32(v)
+#define    IFLT(v)          _mm_cvtepi32_ps(v)
+
+// SSE2 has no 32 bit mullo/min/max - the low half of an unsigned
+// product is the same as the signed one
+static inline __m128i IMUL(__m128i a, __m128i b)
+{
+__m128i p02 = _mm_mul_epu32(a, b);
+__m128i p13 = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+return(_mm_unpacklo_epi32(_mm_shuffle_epi32(p02, _MM_SHUFFLE(0, 0, 2, 0)),
+                          _mm_shuffle_epi32(p13, _MM_SHUFFLE(0, 0, 2, 0))));
+}
+
+static inline __m128i IMIN(__m128i a, __m128i b)
+{
+__m128i m = _mm_cmpgt_epi32(a, b);
+
+return(_mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a)));
+}
+
+static inline __m128i IMAX(__m128i a, __m128i b)
+{
+__m128i m = _mm_cmpgt_epi32(a, b);
+
+return(_mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)));
+}
+#endif
+
+//***************************************************************************
+//     DESCRIPTION:        One control period for cells lo..hi, SIMD
+//     RETURN:             None
+//     NOTES:              count is the same for every cell so only the
+//                         proportional band test needs a per lane select.
+//                         The estimator runs in 32 bit integer lanes.
+//***************************************************************************
+static void step_simd(size_t lo, size_t hi, unsigned count, unsigned k)
+{
+const struct pid_law_cfg *c = &fleet.cfg;
+const VF lv = VSET(c->lv_bits), span = VSET(c->hv_bits - c->lv_bits);
+const VF maxm = VSET(c->max_mpa), tsp = VSET(c->tsp), pb = VSET(c->pb);
+const VF npb = VSET(-c->pb), kp = VSET(c->Kp), ki = VSET(c->Ki);
+const VF kd = VSET(c->Kd), five = VSET(5.0f), nfive = VSET(-5.0f);
+const VF zero = VSET(0.0f), afull = VSET(ADC_FULL);
+const VF isum = VSET(R_SIZE * c->max_mpa), rsz = VSET((float)R_SIZE);
+const VF tobits = VSET(DAC_MAX / (2 * VOLTS_MAX)), dmax = VSET(DAC_MAX);
+const VF tovolts = VSET((2 * VOLTS_MAX) / DAC_MAX);
+const VF escale = VSET(c->est_scale);
+const VI ea = ISET(c->est_alpha), eb = ISET(c->est_beta);
+const VI rmax = ISET(32767), rmin = ISET(-32767);
+float *integ = fleet.integ[count];
+size_t i;
+
+for (i = lo; i < hi; i += LANES)
+       {      VF p = VLD(&fleet.p[i]), adc, mv, err, P, I, D, vin, vout, volts, bits;
+
+              if (count == 0) VST(&fleet.mvstart[i], VLD(&fleet.mvnew[i]));
+              adc = VADD(lv, VDIV(VMUL(p, span), maxm));
+              adc = VTRUNC(VMIN(VMAX(adc, zero), afull));
+              mv  = VDIV(VMUL(VSUB(adc, lv), maxm), span);
+              VST(&fleet.mvnew[i], mv);
+              if (c->est_alpha)
+                     {      VI z = ISLL(ICVT(adc), 8), ex, ev, r;
+
+                            if (k == 0) ex = z, ev = ISET(0);
+                            else   {      ex = ILD(&fleet.ex[i]);
+                                          ev = ILD(&fleet.ev[i]);
+                                          ex = IADD(ex, ev);
+                                          r  = IMAX(IMIN(ISRA(ISUB(z, ex), 4), rmax), rmin);
+                                          ex = IADD(ex, ISRA(IMUL(r, ea), 11));
+                                          ev = IADD(ev, ISRA(IMUL(r, eb), 11));
+                                   }
+                            IST(&fleet.ex[i], ex);
+                            IST(&fleet.ev[i], ev);
+                            VST(&fleet.D[i], VNEG(VMUL(IFLT(ev), escale)));
+                     }
+              else if (count == 0) VST(&fleet.D[i], VDIV(VSUB(VLD(&fleet.mvstart[i]), mv), rsz));
+              D = VLD(&fleet.D[i]);
+              err = VSUB(tsp, mv);
+              VST(&integ[i], err);
+              I = VADD(VADD(VADD(VADD(VLD(&fleet.integ[0][i]), VLD(&fleet.integ[1][i])),
+                  VLD(&fleet.integ[2][i])), VLD(&fleet.integ[3][i])), VLD(&fleet.integ[4][i]));
+              I = VDIV(I, isum);
+              P = VDIV(VMUL(five, err), pb);
+              P = VSEL(VGE(err, pb), five, VSEL(VLE(err, npb), nfive, P));
+              vin  = VADD(VADD(VMUL(kp, P), VMUL(ki, I)), VMUL(kd, D));
+              vin  = VMAX(VMIN(vin, five), nfive);
+              vout = VMUL(kp, P);
+              volts = VSEL(VAND(VNE(P, five), VNE(P, nfive)), vin, vout);
+              volts = VMIN(volts, five);
+              bits = VTRUNC(VMIN(VMAX(VMUL(VADD(volts, five), tobits), zero), dmax));
+              volts = VSUB(VMUL(bits, tovolts), five);
+              p = VSUB(VADD(p, VMUL(VLD(&fleet.kq[i]), volts)), VMUL(VLD(&fleet.kl[i]), p));
+              p = VMAX(p, zero);
+              VST(&fleet.p[i], p);
+              VST(&fleet.pmax[i], VMAX(VLD(&fleet.pmax[i]), p));
+       }
+}
+#endif
+
+//***************************************************************************
+//     DESCRIPTION:        Re-run a block through pid_law_step() one cell
+//                         at a time and compare the plant trajectory.
+//     RETURN:             Number of cells that differ
+//***************************************************************************
+static long check_block(size_t lo, size_t hi)
+{
+struct pid_law_cfg c;
+struct pid_law_state s;
+uint16_t ring[DEAD_MAX / STEP_MS + 1];
+long bad = 0;
+size_t i;
+unsigned k;
+
+for (i = lo; i < hi && i < fleet.used; i++)
+       {      float p = 0;
+
+              pid_law_init(&s, 0);
+              for (k = 0; k < fleet.dead; k++) ring[k] = pid_law_dac_bits(0);
+              for (k = 0; k < fleet.steps; k++)
+                     {      uint16_t adc = (uint16_t)plant_adc(&fleet.cfg, p), dac;
+                            pass_cfg(&c, k, adc);
+                            dac = pid_law_step(&c, &s, adc);
+                            dac = plant_delay(ring, k, dac);
+                            p = plant_step(p, fleet.kq[i], fleet.kl[i], pid_law_dac_to_volts(dac));
+                     }
+              if (p != fleet.p[i])
+                     {      if (!bad)
+                                   fprintf(stderr, "\nfleet_sim: cell %zu differs"
+                                           " (%f ref, %f fleet)", i, p, fleet.p[i]);
+                            bad++;
+                     }
+       }
+return(bad);
+}
+
+static void *worker(void *arg)
+{
+size_t lo;
+unsigned k, count;
+long bad;
+
+(void)arg;
+while ((lo = __atomic_fetch_add(&fleet.next, BLOCK, __ATOMIC_RELAXED)) < fleet.n)
+       {      for (k = 0, count = 0; k < fleet.steps; k++)
+                     {
+                     if (fleet.law) { step_law(lo, lo + BLOCK, k); continue; }
+#if LANES > 1
+                     if (!fleet.scalar) step_simd(lo, lo + BLOCK, count, k);
+                     else
+#endif
+                            step_scalar(lo, lo + BLOCK, count, k);
+                     if (++count == R_SIZE) count = 0;
+                     }
+              if (fleet.check && !fleet.law && (bad = check_block(lo, lo + BLOCK)) != 0)
+                     __atomic_fetch_add(&fleet.mismatches, bad, __ATOMIC_RELAXED);
+       }
+return(NULL);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Gain table from "n,Kp,Ki,Kd" lines (sysid output)
+//     RETURN:             0, or -1 if the file is missing or short
+//     NOTES:              Gains are held Q6.10 as in the EEPROM table.
+//***************************************************************************
+static int load_gs(const char *name)
+{
+FILE *fp = fopen(name, "r");
+char line[160];
+float kp, ki, kd;
+int n, got = 0;
+
+if (!fp) { perror(name); return(-1); }
+while (fgets(line, sizeof(line), fp))
+       if (sscanf(line, " %d,%f,%f,%f", &n, &kp, &ki, &kd) == 4
+           && n >= 0 && n < GS_POINTS)
+              {      fleet.gs.Kp[n] = (uint16_t)(kp * (1 << GS_SHIFT) + 0.5f);
+                     fleet.gs.Ki[n] = (uint16_t)(ki * (1 << GS_SHIFT) + 0.5f);
+                     fleet.gs.Kd[n] = (uint16_t)(kd * (1 << GS_SHIFT) + 0.5f);
+                     got |= 1 << n;
+              }
+fclose(fp);
+if (got != (1 << GS_POINTS) - 1)
+       {      fprintf(stderr, "fleet_sim: %s needs gain table points 0 to %d\n",
+                      name, GS_POINTS - 1);
+              return(-1);
+       }
+fleet.gs.enabled = 1;
+return(0);
+}
+
+static double now_s(void)
+{
+struct timespec t;
+
+clock_gettime(CLOCK_MONOTONIC, &t);
+return(t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+int main(int argc, char **argv)
+{
+size_t cells = 4096, i, unsettled = 0, worst = 0;
+int threads = (int)sysconf(_SC_NPROCESSORS_ONLN), a;
+const char *csv = NULL, *gs = NULL;
+pthread_t *tid;
+double t0, dt, overshoot = 0, final_err = 0;
+FILE *fp;
+float est_q = 5.0f, est_r = 0.05f, sm_km = 0, sm_tau = 0, sm_dead = 0, dead_ms = 0;
+
+// Defaults as init_setup_defaults()
+fleet.cfg.Kp = 5.0f;  fleet.cfg.Ki = 0.1f;  fleet.cfg.Kd = 0.1f;
+fleet.cfg.tsp = 220.0f; fleet.cfg.pb = 20.0f;
+fleet.cfg.lv_bits = 12000; fleet.cfg.hv_bits = 60000; fleet.cfg.max_mpa = 300;
+fleet.cfg.step_ms = STEP_MS;
+fleet.steps = 3000;
+
+for (a = 1; a < argc; a++)
+       {      const char *v = (a + 1 < argc) ? argv[a + 1] : "0";
+              if      (!strcmp(argv[a], "-n"))  cells = strtoul(v, NULL, 0), a++;
+              else if (!strcmp(argv[a], "-s"))  fleet.steps = strtoul(v, NULL, 0), a++;
+              else if (!strcmp(argv[a], "-t"))  threads = atoi(v), a++;
+              else if (!strcmp(argv[a], "-o"))  csv = v, a++;
+              else if (!strcmp(argv[a], "-kp")) fleet.cfg.Kp = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-ki")) fleet.cfg.Ki = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-kd")) fleet.cfg.Kd = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-sp")) fleet.cfg.tsp = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-pb")) fleet.cfg.pb = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-scalar")) fleet.scalar = 1;
+              else if (!strcmp(argv[a], "-check"))  fleet.check = 1;
+              else if (!strcmp(argv[a], "-dead"))  dead_ms = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-estq"))  est_q = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-estr"))  est_r = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-ffkv"))  fleet.cfg.ff_kv = strtof(v, NULL), fleet.cfg.ff_on = 1, a++;
+              else if (!strcmp(argv[a], "-ffkpl")) fleet.cfg.ff_kpl = strtof(v, NULL), fleet.cfg.ff_on = 1, a++;
+              else if (!strcmp(argv[a], "-rate"))  fleet.rate = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-gs"))    gs = v, a++;
+              else if (!strcmp(argv[a], "-smith") && a + 3 < argc)
+                     {      sm_km   = strtof(argv[a + 1], NULL);
+                            sm_tau  = strtof(argv[a + 2], NULL);
+                            sm_dead = strtof(argv[a + 3], NULL);
+                            a += 3;
+                     }
+              else   {      fprintf(stderr, "fleet_sim: unknown option %s\n", argv[a]);
+                            return(2);
+                     }
+       }
+if (cells == 0)
+       {      fprintf(stderr, "fleet_sim: -n needs at least 1 cell\n");
+              return(2);
+       }
+if (threads < 1) threads = 1;
+if (dead_ms < 0 || dead_ms > DEAD_MAX)
+       {      fprintf(stderr, "fleet_sim: -dead is 0 to %d ms\n", DEAD_MAX);
+              return(2);
+       }
+fleet.dead = (unsigned)(dead_ms / STEP_MS + 0.5f);
+pid_law_est_init(&fleet.cfg, est_q, est_r, STEP_MS);
+pid_law_smith_init(&fleet.cfg, sm_km, sm_tau, sm_dead, STEP_MS);
+pid_law_gs_init(&fleet.gs, &fleet.cfg);
+if (gs && load_gs(gs)) return(2);
+fleet.law = fleet.dead || fleet.cfg.sm_d
+            || fleet.cfg.ff_on || fleet.rate > 0 || fleet.gs.enabled;
+init_fleet(cells);
+
+printf("Fleet: %zu cells, %u steps (%.1f s of rig time), %d threads, %s kernel\n",
+       fleet.used, fleet.steps, fleet.steps * STEP_MS / 1000.0, threads,
+       fleet.law ? "law" : (fleet.scalar || LANES == 1) ? "scalar" : KERNEL_NAME);
+printf("PID  : Kp=%.2f Ki=%.2f Kd=%.2f TSP=%.1f PB=%.1f\n",
+       fleet.cfg.Kp, fleet.cfg.Ki, fleet.cfg.Kd, fleet.cfg.tsp, fleet.cfg.pb);
+if (fleet.law)
+       printf("Law  : plant dead time %u steps, estimator %s, Smith %u steps, "
+              "ff %s, ramp %.0f KPa/min, gain table %s\n",
+              fleet.dead, fleet.cfg.est_alpha ? "on" : "off", fleet.cfg.sm_d,
+              fleet.cfg.ff_on ? "on" : "off", fleet.rate, fleet.gs.enabled ? "on" : "off");
+
+tid = calloc(threads, sizeof(*tid));
+t0 = now_s();
+for (a = 0; a < threads; a++) pthread_create(&tid[a], NULL, worker, NULL);
+for (a = 0; a < threads; a++) pthread_join(tid[a], NULL);
+dt = now_s() - t0;
+
+for (i = 0; i < fleet.used; i++)
+       {      double e = fabs(fleet.cfg.tsp - fleet.p[i]);
+              double o = fleet.pmax[i] - fleet.cfg.tsp;
+              if (e > final_err) final_err = e, worst = i;
+              if (o > overshoot) overshoot = o;
+              if (e > 1.0) unsettled++;
+       }
+printf("Time : %.3f s, %.3g cell-steps/s\n", dt, (double)fleet.used * fleet.steps / dt);
+printf("Final: worst error %.3f MPa (cell %zu), %zu cells outside 1 MPa, "
+       "peak overshoot %.3f MPa\n", final_err, worst, unsettled, overshoot);
+if (fleet.check && fleet.law)
+       printf("Check: skipped, the law kernel is pid_law_step()\n");
+else if (fleet.check)
+       printf("Check: %ld cells differ from pid_law_step()\n", fleet.mismatches);
+
+if (csv)
+       {      if (!(fp = fopen(csv, "w")))
+                     {      perror(csv);
+                            return(1);
+                     }
+              fprintf(fp, "cell,kq,kl,final_mpa,peak_mpa\n");
+              for (i = 0; i < fleet.used; i++)
+                     fprintf(fp, "%zu,%g,%g,%g,%g\n", i, fleet.kq[i], fleet.kl[i],
+                             fleet.p[i], fleet.pmax[i]);
+              fclose(fp);
+       }
+return(fleet.mismatches ? 1 : 0);
+}
@@ -0,0 +1,366 @@
+//*******************************************************************
+//   Program:    log_replay.c
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Replays captured console logs from run_pid() through the host copy
+// of the control law (pid_law.h) and diffs the P, I, D and DAC output
+// against what the rig printed, so a controller change can be checked
+// against production history before it is flashed.
+//
+//   Build:  gcc -O2 -o log_replay log_replay.c -lm
+//   Usage:  log_replay [options] file.log [file.log ...]   (- = stdin)
+//           -kp/-ki/-kd n   Gains (default from the "Starting PID" line)
+//           -pb n           Proportional band MPa (20)
+//           -lv/-hv n       cal.LV_BITS / HV_BITS (12000 / 60000)
+//           -max n          cal.MAX_MPA (300)
+//           -ffkv/-ffkpl n  Feed-forward Kv and plant gain (off)
+//           -estq/-estr n   Estimator noise as trx.est_q / est_r (default
+//                           from the banner, else off)
+//           -smith k t d    Smith model gain MPa/V, lag s, dead time ms
+//                           (default from the banner, else off)
+//           -tol n          Volts difference counted as a mismatch (0.006)
+//           -v              Print every mismatch, not just the first 10
+//
+// Note 1: Files are memory mapped, pipes and stdin are read in 1MB
+//         blocks, either way a line is parsed in place without copying.
+// Note 2: run_pid() prints one record every LOG_EVERY passes. I and D
+//         depend on passes that were not printed so with LOG_EVERY > 1
+//         only P and MV compare exactly - build the firmware with
+//         LOG_EVERY 1 for a full replay.
+// Note 3: The printed Count wraps at 65535 - gaps are worked out mod
+//         65536 and a gap other than the first one seen restarts the
+//         replay from that record. I, D and DAC are compared once the
+//         R_SIZE windows have filled again after a restart.
+// Note 4: SP is printed rounded to 0.01 MPa, so the setpoint is taken
+//         as ERR plus the MV worked out from ADC - ERR is printed in
+//         full. Logs without ERR fall back to SP.
+// Note 5: The banner also carries the estimator (EstQ, EstR) and
+//         Smith (SmKm, SmTau, SmDead) terms. Older banners do not, give
+//         -estq/-estr/-smith for those.
+//*******************************************************************
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pid_law.h"
+
+#define    BLOCK_SIZE       (1 << 20)
+#define    SHOW_MAX         10
+
+struct RECORD
+{    unsigned count;
+     float sp, mv, volts, err, P, I, D, rpm;
+     unsigned adc;
+};
+
+struct STATS
+{    double max, sum2;
+     long   bad;
+};
+
+struct REPLAY
+{    struct pid_law_cfg cfg;
+     struct pid_law_state st;
+     int    gains_set     ;    // Gains given on the command line
+     int    started       ;
+     int    warm          ;    // Records since a restart
+     unsigned last_count  ;
+     unsigned every       ;    // Passes per printed record (0 = not known)
+     float  tol           ;
+     int    verbose       ;
+     float  est_q, est_r  ;    // Estimator noise terms (0 = windowed D)
+     float  sm_km, sm_tau, sm_dead;  // Smith model (0 = off)
+     int    est_set, smith_set;  // Given on the command line
+     long   lines, records, restarts, shown;
+     size_t bytes         ;
+     struct STATS mv, P, I, D, volts;
+     const char *file     ;
+     long   line          ;
+}    rp ;
+
+//***************************************************************************
+//     DESCRIPTION:        Fixed point decimal as printed by CCS "%f"
+//     RETURN:             Value, *pp moved past it. NAN if no digits.
+//     NOTES:              Stops at the second '.' so the progress dots
+//                         after RPM are left alone.
+//***************************************************************************
+static float get_num(const char **pp, const char *end)
+{
+const char *p = *pp;
+double v = 0, scale = 1;
+int neg = 0, digits = 0;
+
+while (p < end && *p == ' ') p++;
+if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0'), digits++;
+if (p < end && *p == '.')
+       {      p++;
+              while (p < end && *p >= '0' && *p <= '9')
+                     scale *= 0.1, v += (*p++ - '0') * scale, digits++;
+       }
+*pp = p;
+if (!digits) return(NAN);
+return((float)(neg ? -v : v));
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Find key in p..end and parse the number after it
+//     RETURN:             Value, NAN if the key is not there
+//***************************************************************************
+static float get_field(const char **pp, const char *end, const char *key)
+{
+size_t n = strlen(key);
+const char *p = *pp;
+
+while (p + n <= end && memcmp(p, key, n)) p++;
+if (p + n > end) return(NAN);
+p += n;
+*pp = p;
+return(get_num(pp, end));
+}
+
+static int parse_record(const char *p, const char *end, struct RECORD *r)
+{
+float v;
+
+if (isnan(v = get_field(&p, end, "Count:"))) return(0);
+r->count = (unsigned)v;
+r->sp    = get_field(&p, end, "SP:");
+r->mv    = get_field(&p, end, "MV:");
+if (isnan(v = get_field(&p, end, "ADC:"))) return(0);
+r->adc   = (unsigned)v;
+r->volts = get_field(&p, end, "DAC/PID:");
+r->err   = get_field(&p, end, "ERR:");
+r->P     = get_field(&p, end, "(P:");
+r->I     = get_field(&p, end, "I:");
+r->D     = get_field(&p, end, "D:");
+r->rpm   = get_field(&p, end, "RPM:");
+return(!isnan(r->sp) && !isnan(r->volts) && !isnan(r->D));
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Pick the setup up from the run_pid() banner
+//     RETURN:             None
+//     NOTES:              "Starting PID Control Loop with (Kp=..,Ki=..,Kd=..,
+//                         EstQ=..,EstR=..,SmKm=..,SmTau=..,SmDead=..)" also
+//                         means the loop state was reset on the rig.
+//***************************************************************************
+static void parse_banner(const char *p, const char *end)
+{
+float kp, ki, kd, q, r, km, tau, dead;
+
+if (isnan(kp = get_field(&p, end, "Kp="))) return;
+ki = get_field(&p, end, "Ki=");
+kd = get_field(&p, end, "Kd=");
+if (!rp.gains_set && !isnan(ki) && !isnan(kd))
+       rp.cfg.Kp = kp, rp.cfg.Ki = ki, rp.cfg.Kd = kd;
+q    = get_field(&p, end, "EstQ=");
+r    = get_field(&p, end, "EstR=");
+km   = get_field(&p, end, "SmKm=");
+tau  = get_field(&p, end, "SmTau=");
+dead = get_field(&p, end, "SmDead=");
+if (!rp.est_set && !isnan(q) && !isnan(r))
+       rp.est_q = q, rp.est_r = r;
+if (!rp.smith_set && !isnan(km) && !isnan(tau) && !isnan(dead))
+       rp.sm_km = km, rp.sm_tau = tau, rp.sm_dead = dead;
+pid_law_est_init(&rp.cfg, rp.est_q, rp.est_r, 20);
+pid_law_smith_init(&rp.cfg, rp.sm_km, rp.sm_tau, rp.sm_dead, 20);
+rp.started = 0;
+}
+
+static void compare(struct STATS *s, const char *name, float logged,
+                    float replay, float tol)
+{
+double d = fabs((double)logged - replay);
+
+if (isnan(logged)) return;
+s->sum2 += d * d;
+if (d > s->max) s->max = d;
+if (d > tol)
+       {      s->bad++;
+              if (rp.verbose || rp.shown < SHOW_MAX)
+                     printf("%s:%ld: %s logged %f replay %f\n",
+                            rp.file, rp.line, name, logged, replay);
+              rp.shown++;
+       }
+}
+
+static void process_line(const char *p, const char *end)
+{
+struct RECORD r;
+unsigned gap;
+float sp;
+
+rp.lines++;
+if (end - p > 12 && memmem(p, end - p, "Starting PID", 12))
+       {      parse_banner(p, end);
+              return;
+       }
+if (!memmem(p, end - p, "Count:", 6) || !parse_record(p, end, &r)) return;
+rp.records++;
+sp = isnan(r.err) ? r.sp : r.err + pid_law_mpa(&rp.cfg, r.adc);   // Note 4
+
+gap = (r.count - rp.last_count) & 0xffff;
+if (rp.started && !rp.every) rp.every = gap;
+if (!rp.started || gap != rp.every)
+       {      if (rp.started) rp.restarts++;
+              pid_law_init(&rp.st, pid_law_mpa(&rp.cfg, r.adc));
+              rp.st.count = r.count % R_SIZE;
+              rp.st.sp_last = sp;
+              rp.started = 1;
+              rp.warm = 0;
+       }
+rp.last_count = r.count;
+if (rp.every) rp.cfg.step_ms = 20.0f * rp.every;
+
+rp.cfg.tsp = sp;
+pid_law_step(&rp.cfg, &rp.st, (uint16_t)r.adc);
+compare(&rp.mv, "MV", r.mv, rp.st.mvnew, 0.006f);
+compare(&rp.P,  "P",  r.P,  rp.st.P,     1e-5f);
+if (rp.every == 1 && ++rp.warm > 2 * R_SIZE)   // I and D windows refilled
+       {      compare(&rp.I,     "I",   r.I,     rp.st.I,     1e-5f);
+              compare(&rp.D,     "D",   r.D,     rp.st.D,     1e-5f);
+              compare(&rp.volts, "DAC", r.volts, rp.st.volts, rp.tol);
+       }
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Split a buffer into lines
+//     RETURN:             Bytes used, the tail is a part line
+//***************************************************************************
+static size_t process_block(const char *buf, size_t n, int last)
+{
+const char *p = buf, *end = buf + n, *nl;
+
+while (p < end)
+       {      nl = memchr(p, '\n', end - p);
+              if (!nl)
+                     {      if (!last) break;
+                            nl = end;
+                     }
+              rp.line++;
+              process_line(p, nl);
+              p = nl + 1;
+       }
+return((p > end ? end : p) - buf);
+}
+
+static int replay_file(const char *name)
+{
+int fd = strcmp(name, "-") ? open(name, O_RDONLY) : 0;
+struct stat sb;
+char *buf;
+size_t have = 0, used;
+ssize_t got;
+
+if (fd < 0) { perror(name); return(1); }
+rp.file = name;
+rp.line = 0;
+rp.started = 0;
+if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
+       {      buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+              if (buf != MAP_FAILED)
+                     {      madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+                            process_block(buf, sb.st_size, 1);
+                            rp.bytes += sb.st_size;
+                            munmap(buf, sb.st_size);
+                            if (fd) close(fd);
+                            return(0);
+                     }
+       }
+buf = malloc(BLOCK_SIZE);
+while ((got = read(fd, buf + have, BLOCK_SIZE - have)) > 0)
+       {      have += got;
+              rp.bytes += got;
+              used = process_block(buf, have, 0);
+              if (used == 0 && have == BLOCK_SIZE) used = have;   // No newline
+              memmove(buf, buf + used, have - used);
+              have -= used;
+       }
+process_block(buf, have, 1);
+free(buf);
+if (fd) close(fd);
+return(got < 0);
+}
+
+static void report(const char *name, const struct STATS *s)
+{
+printf("  %-4s max %-10.6f rms %-10.6f mismatches %ld\n", name, s->max,
+       rp.records ? sqrt(s->sum2 / rp.records) : 0, s->bad);
+}
+
+int main(int argc, char **argv)
+{
+struct timespec t0, t1;
+double dt;
+int a, files = 0, rc = 0;
+
+rp.cfg.Kp = 5.0f;  rp.cfg.Ki = 0.1f;  rp.cfg.Kd = 0.1f;
+rp.cfg.pb = 20.0f;
+rp.cfg.lv_bits = 12000; rp.cfg.hv_bits = 60000; rp.cfg.max_mpa = 300;
+rp.cfg.step_ms = 20;
+rp.tol = 0.006f;
+
+clock_gettime(CLOCK_MONOTONIC, &t0);
+for (a = 1; a < argc; a++)
+       {      const char *v = (a + 1 < argc) ? argv[a + 1] : "0";
+              if      (!strcmp(argv[a], "-kp"))  rp.cfg.Kp = strtof(v, NULL), rp.gains_set = 1, a++;
+              else if (!strcmp(argv[a], "-ki"))  rp.cfg.Ki = strtof(v, NULL), rp.gains_set = 1, a++;
+              else if (!strcmp(argv[a], "-kd"))  rp.cfg.Kd = strtof(v, NULL), rp.gains_set = 1, a++;
+              else if (!strcmp(argv[a], "-pb"))  rp.cfg.pb = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-lv"))  rp.cfg.lv_bits = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-hv"))  rp.cfg.hv_bits = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-max")) rp.cfg.max_mpa = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-ffkv"))  rp.cfg.ff_kv = strtof(v, NULL), rp.cfg.ff_on = 1, a++;
+              else if (!strcmp(argv[a], "-ffkpl")) rp.cfg.ff_kpl = strtof(v, NULL), rp.cfg.ff_on = 1, a++;
+              else if (!strcmp(argv[a], "-estq")) rp.est_q = strtof(v, NULL), rp.est_set = 1, a++;
+              else if (!strcmp(argv[a], "-estr")) rp.est_r = strtof(v, NULL), rp.est_set = 1, a++;
+              else if (!strcmp(argv[a], "-smith") && a + 3 < argc)
+                     {      rp.sm_km   = strtof(argv[a + 1], NULL);
+                            rp.sm_tau  = strtof(argv[a + 2], NULL);
+                            rp.sm_dead = strtof(argv[a + 3], NULL);
+                            rp.smith_set = 1;
+                            a += 3;
+                     }
+              else if (!strcmp(argv[a], "-tol")) rp.tol = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-v"))   rp.verbose = 1;
+              else if (argv[a][0] == '-' && argv[a][1])
+                     {      fprintf(stderr, "log_replay: unknown option %s\n", argv[a]);
+                            return(2);
+                     }
+              else   {      pid_law_est_init(&rp.cfg, rp.est_q, rp.est_r, 20);
+                            pid_law_smith_init(&rp.cfg, rp.sm_km, rp.sm_tau, rp.sm_dead, 20);
+                            rc |= replay_file(argv[a]);
+                            files++;
+                     }
+       }
+if (!files)
+       {      fprintf(stderr, "usage: log_replay [options] file.log ... (- for stdin)\n");
+              return(2);
+       }
+clock_gettime(CLOCK_MONOTONIC, &t1);
+dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+printf("Replay: %ld lines, %ld records, %.1f MB in %.3f s (%.3g lines/s, %.1f MB/s)\n",
+       rp.lines, rp.records, rp.bytes / 1e6, dt, rp.lines / dt, rp.bytes / 1e6 / dt);
+printf("PID   : Kp=%.3f Ki=%.3f Kd=%.3f PB=%.1f, %u passes per record, %ld restarts\n",
+       rp.cfg.Kp, rp.cfg.Ki, rp.cfg.Kd, rp.cfg.pb, rp.every, rp.restarts);
+report("MV", &rp.mv);
+report("P", &rp.P);
+if (rp.every == 1)
+       {      report("I", &rp.I);
+              report("D", &rp.D);
+              report("DAC", &rp.volts);
+       }
+else   printf("  I, D and DAC not compared - log has one record every %u passes\n", rp.every);
+if (rp.mv.bad || rp.P.bad || rp.I.bad || rp.D.bad || rp.volts.bad) rc |= 1;
+return(rc);
+}
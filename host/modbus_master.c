@@ -0,0 +1,314 @@
+//*******************************************************************
+//   Program:    modbus_master.c
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Stand-in Modbus RTU master for testing the slave on USB1 (19200 8N1)
+// without the SCADA system. Reads and writes raw registers and can
+// show the run_pid() loop state as named values.
+//
+//   Build:  gcc -O2 -o modbus_master modbus_master.c
+//   Usage:  modbus_master [options] command
+//           -d dev          Serial device (/dev/ttyUSB0)
+//           -a n            Slave address (1)
+//           -t ms           Reply timeout (200)
+//           -f              Show registers as floats (pairs, CCS format)
+//           -v              Print the frames sent and received
+//   Commands:
+//           rh reg n        Read n holding registers (FC 03)
+//           ri reg n        Read n input registers (FC 04)
+//           wr reg val      Write one holding register (FC 06)
+//           wm reg val ...  Write holding registers (FC 16)
+//           wf reg value    Write a float into two holding registers
+//           loop [n]        Show the loop state n times a second (1)
+//
+// Note 1: Each register is two bytes of the firmware structure in PIC
+//         memory order, low word first, so a float is two registers.
+//         Holding 0x000 trx, 0x100 gain table. Input 0x000 loop,
+//         0x100 cal, 0x200 fault record, 0x300 DAC readback errors,
+//         frames and frame errors (three words).
+// Note 2: CCS floats are the Microchip format - exponent in the first
+//         byte, sign at the top of the second. ccs_to_float() and
+//         float_to_ccs() convert to and from IEEE.
+// Note 3: While the control loop runs a read is limited to 10
+//         registers so the reply fits between control passes, larger
+//         reads get exception 3.
+//*******************************************************************
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+
+#define    MB_BUF_SIZE      256
+#define    MB_MAX_REGS      32       // Same as the firmware
+#define    LOOP_REG         0x000    // struct LOOP in the input table
+#define    LOOP_WORDS       28
+#define    LOOP_CHUNK       10       // Read limit while the loop runs
+
+static int fd = -1, slave = 1, timeout_ms = 200, verbose;
+
+static uint16_t crc16(const uint8_t *b, int n)
+{
+uint16_t crc = 0xffff;
+int i;
+
+while (n--)
+       {      crc ^= *b++;
+              for (i = 0; i < 8; i++)
+                     crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+       }
+return(crc);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Microchip 32 bit float (memory order) to IEEE
+//     RETURN:             Value
+//***************************************************************************
+static float ccs_to_float(const uint8_t b[4])
+{
+uint32_t u;
+float f;
+
+if (b[0] == 0) return(0);
+u = ((uint32_t)(b[1] >> 7) << 31) | ((uint32_t)b[0] << 23)
+  | ((uint32_t)(b[1] & 0x7f) << 16) | ((uint32_t)b[2] << 8) | b[3];
+memcpy(&f, &u, 4);
+return(f);
+}
+
+static void float_to_ccs(float f, uint8_t b[4])
+{
+uint32_t u;
+
+memcpy(&u, &f, 4);
+b[0] = (uint8_t)(u >> 23);
+b[1] = (uint8_t)(((u >> 31) << 7) | ((u >> 16) & 0x7f));
+b[2] = (uint8_t)(u >> 8);
+b[3] = (uint8_t)u;
+if (b[0] == 0) memset(b, 0, 4);
+}
+
+// Registers are sent high byte first, memory order is low byte first
+static void regs_to_bytes(const uint16_t *r, int n, uint8_t *b)
+{
+int i;
+
+for (i = 0; i < n; i++)
+       {      b[2*i]   = (uint8_t)r[i];
+              b[2*i+1] = (uint8_t)(r[i] >> 8);
+       }
+}
+
+static int open_port(const char *dev)
+{
+struct termios t;
+
+fd = open(dev, O_RDWR | O_NOCTTY);
+if (fd < 0) { perror(dev); return(-1); }
+tcgetattr(fd, &t);
+cfmakeraw(&t);
+cfsetispeed(&t, B19200);
+cfsetospeed(&t, B19200);
+t.c_cflag |= CLOCAL | CREAD;
+t.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+t.c_cc[VMIN]  = 0;
+t.c_cc[VTIME] = 0;
+tcsetattr(fd, TCSANOW, &t);
+tcflush(fd, TCIOFLUSH);
+return(0);
+}
+
+static void dump(const char *tag, const uint8_t *b, int n)
+{
+int i;
+
+if (!verbose) return;
+fprintf(stderr, "%s", tag);
+for (i = 0; i < n; i++) fprintf(stderr, " %02X", b[i]);
+fprintf(stderr, "\n");
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Send a request and wait for the reply
+//     RETURN:             Reply length without CRC, -1 on error
+//     NOTES:              The reply is complete when the 3.5 character
+//                         gap is seen (4ms here, allowing for USB serial
+//                         adapters) or the expected length arrives.
+//***************************************************************************
+static int transact(uint8_t *req, int n, uint8_t *rsp, int expect)
+{
+uint16_t crc;
+struct pollfd p = { fd, POLLIN, 0 };
+int got = 0, r, wait = timeout_ms;
+
+crc = crc16(req, n);
+req[n++] = (uint8_t)crc;
+req[n++] = (uint8_t)(crc >> 8);
+dump("TX", req, n);
+tcflush(fd, TCIFLUSH);
+if (write(fd, req, n) != n) { perror("write"); return(-1); }
+if (req[0] == 0) return(0);      // Broadcast, no reply
+
+while (got < expect + 2 && poll(&p, 1, wait) > 0)
+       {      r = read(fd, rsp + got, MB_BUF_SIZE - got);
+              if (r <= 0) break;
+              got += r;
+              wait = 4;
+              if (got >= 5 && (rsp[1] & 0x80)) break;
+       }
+dump("RX", rsp, got);
+if (got < 5)                    { fprintf(stderr, "No reply\n"); return(-1); }
+if (crc16(rsp, got - 2) != (rsp[got-2] | rsp[got-1] << 8))
+                                { fprintf(stderr, "Bad CRC\n");  return(-1); }
+if (rsp[0] != req[0])           { fprintf(stderr, "Wrong slave %d\n", rsp[0]); return(-1); }
+if (rsp[1] & 0x80)
+       {      fprintf(stderr, "Exception %d\n", rsp[2]);
+              return(-1);
+       }
+return(got - 2);
+}
+
+static int read_regs(int fc, int reg, int n, uint16_t *out)
+{
+uint8_t req[8], rsp[MB_BUF_SIZE];
+int i, len;
+
+if (n < 1 || n > MB_MAX_REGS) { fprintf(stderr, "1 to %d registers\n", MB_MAX_REGS); return(-1); }
+req[0] = slave;  req[1] = fc;
+req[2] = reg >> 8; req[3] = reg;
+req[4] = n >> 8;   req[5] = n;
+len = transact(req, 6, rsp, 3 + 2 * n);
+if (len < 0) return(-1);
+if (len != 3 + 2 * n || rsp[2] != 2 * n) { fprintf(stderr, "Short reply\n"); return(-1); }
+for (i = 0; i < n; i++) out[i] = (rsp[3+2*i] << 8) | rsp[4+2*i];
+return(0);
+}
+
+static int write_regs(int reg, int n, const uint16_t *v)
+{
+uint8_t req[MB_BUF_SIZE], rsp[MB_BUF_SIZE];
+int i;
+
+if (n == 1)
+       {      req[0] = slave;  req[1] = 6;
+              req[2] = reg >> 8; req[3] = reg;
+              req[4] = v[0] >> 8; req[5] = v[0];
+              return(transact(req, 6, rsp, 6) < 0 ? -1 : 0);
+       }
+req[0] = slave;  req[1] = 16;
+req[2] = reg >> 8; req[3] = reg;
+req[4] = n >> 8;   req[5] = n;
+req[6] = 2 * n;
+for (i = 0; i < n; i++) { req[7+2*i] = v[i] >> 8; req[8+2*i] = v[i]; }
+return(transact(req, 7 + 2 * n, rsp, 6) < 0 ? -1 : 0);
+}
+
+static void show_regs(int reg, int n, const uint16_t *r, int as_float)
+{
+uint8_t b[2 * MB_MAX_REGS];
+int i;
+
+if (!as_float)
+       {      for (i = 0; i < n; i++)
+                     printf("0x%03X  0x%04X  %u\n", reg + i, r[i], r[i]);
+              return;
+       }
+regs_to_bytes(r, n, b);
+for (i = 0; i + 1 < n; i += 2)
+       printf("0x%03X  %g\n", reg + i, ccs_to_float(b + 2 * i));
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Show struct LOOP from the input registers
+//     NOTES:              Layout must match struct LOOP in the firmware.
+//***************************************************************************
+static int show_loop(void)
+{
+static const char *name[10] = { "MV", "P", "I", "D", "Volts", "FF",
+                                "Kp", "Ki", "Kd", "RPM" };
+uint16_t r[LOOP_WORDS];
+uint8_t  b[2 * LOOP_WORDS];
+int i, n;
+
+for (i = 0; i < LOOP_WORDS; i += n)
+       {      n = LOOP_WORDS - i < LOOP_CHUNK ? LOOP_WORDS - i : LOOP_CHUNK;
+              if (read_regs(4, LOOP_REG + i, n, r + i)) return(-1);
+       }
+regs_to_bytes(r, LOOP_WORDS, b);
+printf("Count:%05u ADC:%05u", b[42] | b[43] << 8, b[40] | b[41] << 8);
+for (i = 0; i < 10; i++) printf(" %s:%.3f", name[i], ccs_to_float(b + 4 * i));
+printf(" MVf:%.3f Rate:%.5f Smith:%.3f", ccs_to_float(b + 44), ccs_to_float(b + 48),
+       ccs_to_float(b + 52));
+printf("\n");
+fflush(stdout);
+return(0);
+}
+
+static void usage(void)
+{
+fprintf(stderr, "usage: modbus_master [-d dev] [-a n] [-t ms] [-f] [-v] "
+                "rh|ri reg n | wr reg val | wm reg val.. | wf reg value | loop [n]\n");
+exit(1);
+}
+
+int main(int argc, char **argv)
+{
+const char *dev = "/dev/ttyUSB0";
+uint16_t r[MB_MAX_REGS];
+uint8_t  b[4];
+int i, n, reg, as_float = 0, rate;
+struct timespec ts;
+
+for (i = 1; i < argc && argv[i][0] == '-'; i++)
+       {      if      (!strcmp(argv[i], "-d") && i+1 < argc) dev = argv[++i];
+              else if (!strcmp(argv[i], "-a") && i+1 < argc) slave = atoi(argv[++i]);
+              else if (!strcmp(argv[i], "-t") && i+1 < argc) timeout_ms = atoi(argv[++i]);
+              else if (!strcmp(argv[i], "-f")) as_float = 1;
+              else if (!strcmp(argv[i], "-v")) verbose = 1;
+              else usage();
+       }
+if (i >= argc) usage();
+if (open_port(dev)) return(1);
+
+if (!strcmp(argv[i], "loop"))
+       {      rate = (i+1 < argc) ? atoi(argv[i+1]) : 1;
+              if (rate < 1) rate = 1;
+              ts.tv_sec  = rate > 1 ? 0 : 1;
+              ts.tv_nsec = rate > 1 ? 1000000000L / rate : 0;
+              for (;;)
+                     {      show_loop();
+                            nanosleep(&ts, NULL);
+                     }
+       }
+if (i + 2 >= argc) usage();
+reg = (int)strtol(argv[i+1], NULL, 0);
+
+if (!strcmp(argv[i], "rh") || !strcmp(argv[i], "ri"))
+       {      n = (int)strtol(argv[i+2], NULL, 0);
+              if (read_regs(argv[i][1] == 'h' ? 3 : 4, reg, n, r)) return(1);
+              show_regs(reg, n, r, as_float);
+              return(0);
+       }
+if (!strcmp(argv[i], "wr"))
+       {      r[0] = (uint16_t)strtol(argv[i+2], NULL, 0);
+              return(write_regs(reg, 1, r) ? 1 : 0);
+       }
+if (!strcmp(argv[i], "wm"))
+       {      for (n = 0; i + 2 + n < argc && n < MB_MAX_REGS; n++)
+                     r[n] = (uint16_t)strtol(argv[i+2+n], NULL, 0);
+              return(write_regs(reg, n, r) ? 1 : 0);
+       }
+if (!strcmp(argv[i], "wf"))
+       {      float_to_ccs((float)atof(argv[i+2]), b);
+              r[0] = b[0] | b[1] << 8;
+              r[1] = b[2] | b[3] << 8;
+              return(write_regs(reg, 2, r) ? 1 : 0);
+       }
+usage();
+return(1);
+}
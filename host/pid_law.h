@@ -0,0 +1,328 @@
+//*******************************************************************
+//   File:       pid_law.h
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Host copy of the control law used by task_control() (run_pid()) in
+// PID-Controller-with-Velocity-V4.c so that simulators and log tools
+// on the PC step exactly the same arithmetic as the PIC.
+// The firmware is the reference - if run_pid() changes then this
+// file must be changed to match.
+// Note 1: get_mpa(), get_dac_volts() and get_dac_bits() are the
+//         linear scalings used on the rig (LV_BITS..HV_BITS maps to
+//         0..MAX_MPA, P is +/-5V across the proportional band and the
+//         AD7243 is bipolar +/-5V over 12 bits).
+// Note 2: CCS uses the Microchip 32 bit float format, results agree
+//         with IEEE floats here to within rounding of the last bit.
+// Note 3: est_alpha 0 leaves D on the R_SIZE window. Otherwise D is
+//         -rate from the fixed point alpha-beta estimator, set up by
+//         pid_law_est_init() as est_init() does on the PIC.
+// Note 4: sm_d 0 leaves the Smith predictor out. pid_law_smith_init()
+//         sets up the model as smith_init(), the P, I and D terms then
+//         use MV plus the model correction (mvfb).
+//*******************************************************************
+#ifndef PID_LAW_H
+#define PID_LAW_H
+
+#include <stdint.h>
+#include <math.h>
+
+#define    R_SIZE           5        // Same as run_pid()
+#define    DAC_MAX          0x0fff
+#define    VOLTS_MAX        5.0f
+#define    GS_POINTS        9        // Same as the firmware gain table
+#define    GS_SHIFT         10
+#define    DAC_MID          0x800
+#define    SMITH_RING       64       // Same as the firmware
+
+struct pid_law_cfg
+{    float Kp, Ki, Kd ;    // Proportional, Integral and Derivative Gain
+     float tsp        ;    // Setpoint for this pass in MPa (trx.rsp)
+     float pb         ;    // Proportional band in MPa
+     float lv_bits    ;    // cal.LV_BITS - ADC value at 0 MPa
+     float hv_bits    ;    // cal.HV_BITS - ADC value at MAX_MPA
+     float max_mpa    ;    // cal.MAX_MPA
+     int   ff_on      ;    // trx.ff_on
+     float ff_kv      ;    // trx.ff_kv - volts per MPa/min of SP slope
+     float ff_kpl     ;    // trx.ff_kpl - static plant gain MPa/V
+     float step_ms    ;    // Time between passes (for the SP slope)
+     int16_t est_alpha;    // Estimator gains Q15 (0 = windowed D)
+     int16_t est_beta ;
+     float est_scale  ;    // Q8 counts to MPa
+     int16_t sm_a     ;    // Smith lag Q15 per sample
+     int16_t sm_k     ;    // Smith gain Q8 counts per DAC LSB
+     uint8_t sm_d     ;    // Smith dead time in samples (0 = off)
+};
+
+struct pid_law_state
+{    float integ[R_SIZE];  // Error FIFO used for I
+     float mvstart    ;    // MV at the start of the D window
+     float mvnew      ;    // Latest MV in MPa
+     float P, I, D    ;    // Last terms (as printed by run_pid)
+     float volts      ;    // Last output before DAC conversion
+     float sp_last    ;    // Setpoint on the previous pass
+     uint16_t count   ;    // Position in the R_SIZE window
+     int32_t est_x    ;    // Estimate in ADC counts, Q8
+     int32_t est_v    ;    // Rate in counts per sample, Q8
+     int   est_primed ;
+     float mvf, rate  ;    // loop.mvf and loop.rate
+     int32_t sm_y     ;    // Smith model output, counts Q8
+     int32_t sm_ring[SMITH_RING];
+     uint8_t sm_pos   ;
+     uint16_t sm_dac  ;    // DAC code driving the model
+     float smith      ;    // loop.smith
+     float smith_last ;
+     float mvfb       ;    // MV plus the Smith correction
+};
+
+struct pid_law_gs
+{    uint16_t Kp[GS_POINTS];    // Q6.10 as stored in EEPROM
+     uint16_t Ki[GS_POINTS];
+     uint16_t Kd[GS_POINTS];
+     int enabled      ;
+     uint32_t scale   ;    // Set by pid_law_gs_init()
+};
+
+//***************************************************************************
+//     DESCRIPTION:        ADC bits to MPa using the calibration structure
+//     RETURN:             Pressure in MPa
+//***************************************************************************
+static inline float pid_law_mpa(const struct pid_law_cfg *c, float adc)
+{
+return((adc - c->lv_bits) * c->max_mpa / (c->hv_bits - c->lv_bits));
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Proportional term as volts across the band
+//     RETURN:             -5 to +5, exactly +/-5 outside the band
+//***************************************************************************
+static inline float pid_law_dac_volts(float mv, float sp, float pb)
+{
+float err = sp - mv;
+
+if (err >=  pb) return( VOLTS_MAX);
+if (err <= -pb) return(-VOLTS_MAX);
+return(VOLTS_MAX * err / pb);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Volts to AD7243 code (bipolar +/-5V, 12 bits)
+//     RETURN:             0 to 0xfff
+//***************************************************************************
+static inline uint16_t pid_law_dac_bits(float volts)
+{
+float bits = (volts + VOLTS_MAX) * (DAC_MAX / (2 * VOLTS_MAX));
+
+if (bits < 0)       return(0);
+if (bits > DAC_MAX) return(DAC_MAX);
+return((uint16_t)bits);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        AD7243 code back to output volts
+//     RETURN:             -5 to +5
+//***************************************************************************
+static inline float pid_law_dac_to_volts(uint16_t dac)
+{
+return((float)dac * ((2 * VOLTS_MAX) / DAC_MAX) - VOLTS_MAX);
+}
+
+static inline void pid_law_init(struct pid_law_state *s, float mv)
+{
+int i;
+
+for (i = 0; i < R_SIZE; i++) s->integ[i] = 0;
+s->mvstart = s->mvnew = s->sp_last = mv;
+s->P = s->I = s->D = s->volts = 0;
+s->count = 0;
+s->est_x = s->est_v = 0;
+s->est_primed = 0;
+s->mvf = s->rate = 0;
+for (i = 0; i < SMITH_RING; i++) s->sm_ring[i] = 0;
+s->sm_y = 0;
+s->sm_pos = 0;
+s->sm_dac = DAC_MID;
+s->smith = s->smith_last = 0;
+s->mvfb = mv;
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Estimator gains from the noise terms as est_init()
+//     RETURN:             Gains written into c (zero if q or r is 0)
+//     NOTES:              q in MPa/s^2, r in MPa, sample_ms the ADC period.
+//                         Needs lv_bits, hv_bits and max_mpa set first.
+//***************************************************************************
+static inline void pid_law_est_init(struct pid_law_cfg *c, float q, float r,
+                                    float sample_ms)
+{
+float lam, k, a, b, t = sample_ms / 1000.0f;
+
+c->est_alpha = c->est_beta = 0;
+c->est_scale = c->max_mpa / ((c->hv_bits - c->lv_bits) * 256.0f);
+if (q <= 0 || r <= 0) return;
+lam = q * t * t / r;
+k   = (4 + lam - sqrtf(8 * lam + lam * lam)) / 4;
+a   = 1 - k * k;
+b   = 2 * (2 - a) - 4 * sqrtf(1 - a);
+c->est_alpha = (int16_t)(a * 32767);
+c->est_beta  = (int16_t)(b * 32767);
+if (c->est_alpha < 1) c->est_alpha = 1;
+if (c->est_beta < 1)  c->est_beta = 1;
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Smith model from the setup terms as smith_init()
+//     RETURN:             Model written into c (sm_d 0 if off)
+//     NOTES:              km MPa/V, tau s, dead ms, sample_ms the ADC
+//                         period. Call after pid_law_est_init().
+//***************************************************************************
+static inline void pid_law_smith_init(struct pid_law_cfg *c, float km, float tau,
+                                      float dead, float sample_ms)
+{
+float k;
+
+c->sm_d = 0;
+if (km == 0 || tau <= 0 || dead <= 0) return;
+c->sm_a = (int16_t)(32767 * (1 - expf(-(sample_ms / 1000.0f) / tau)));
+if (c->sm_a < 1) c->sm_a = 1;
+k = km * (10.0f / 4095) * (c->hv_bits - c->lv_bits) / c->max_mpa * 256;
+if (k > 32767)  k = 32767;
+if (k < -32767) k = -32767;
+c->sm_k = (int16_t)k;
+k = dead / sample_ms + 0.5f;
+if (k < 1) k = 1;
+if (k > SMITH_RING - 1) k = SMITH_RING - 1;
+c->sm_d = (uint8_t)k;
+}
+
+//***************************************************************************
+//     DESCRIPTION:        One Smith model step as smith_update()
+//     RETURN:             None, correction in s->smith
+//***************************************************************************
+static inline void pid_law_smith_update(const struct pid_law_cfg *c,
+                                        struct pid_law_state *s)
+{
+int32_t gap;
+int16_t u, e;
+
+if (!c->sm_d)
+       {      s->smith = 0;
+              return;
+       }
+u   = (int16_t)s->sm_dac - DAC_MID;
+gap = ((int32_t)u * c->sm_k - s->sm_y) >> 8;
+if (gap > 32767)       e = 32767;
+else if (gap < -32767) e = -32767;
+else                   e = (int16_t)gap;
+s->sm_y += ((int32_t)e * c->sm_a) >> 7;
+s->sm_ring[s->sm_pos] = s->sm_y;
+s->smith = (float)(s->sm_y - s->sm_ring[(uint8_t)(s->sm_pos - c->sm_d) & (SMITH_RING - 1)])
+           * c->est_scale;
+s->sm_pos = (s->sm_pos + 1) & (SMITH_RING - 1);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        One estimator step as est_update()
+//     RETURN:             None
+//***************************************************************************
+static inline void pid_law_est_update(const struct pid_law_cfg *c,
+                                      struct pid_law_state *s, uint16_t z)
+{
+int32_t xp, r;
+int16_t e;
+
+if (!s->est_primed)
+       {      s->est_x = (int32_t)z << 8;
+              s->est_v = 0;
+              s->est_primed = 1;
+              return;
+       }
+xp = s->est_x + s->est_v;
+r  = (((int32_t)z << 8) - xp) >> 4;
+if (r > 32767)       e = 32767;
+else if (r < -32767) e = -32767;
+else                 e = (int16_t)r;
+s->est_x = xp + (((int32_t)e * c->est_alpha) >> 11);
+s->est_v += ((int32_t)e * c->est_beta) >> 11;
+}
+
+static inline void pid_law_gs_init(struct pid_law_gs *g, const struct pid_law_cfg *c)
+{
+uint16_t span = (uint16_t)(c->hv_bits - c->lv_bits);
+
+g->scale = span ? ((uint32_t)(GS_POINTS-1) << 24) / span : 0;
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Gain schedule lookup as get_scheduled_gains()
+//     RETURN:             Gains written into c->Kp, Ki and Kd
+//     NOTES:              Call before pid_law_step() when replaying a rig
+//                         that has the table enabled.
+//***************************************************************************
+static inline void pid_law_schedule(struct pid_law_cfg *c,
+                                    const struct pid_law_gs *g, uint16_t adc)
+{
+uint16_t pos;
+int n, frac;
+
+if (!g->enabled) return;
+if (adc < (uint16_t)c->lv_bits) pos = 0;
+else   pos = (uint16_t)(((uint32_t)(adc - (uint16_t)c->lv_bits) * g->scale) >> 16);
+if (pos >= ((GS_POINTS-1) << 8)) pos = ((GS_POINTS-2) << 8) | 0xff;
+n    = pos >> 8;
+frac = pos & 0xff;
+c->Kp = (float)(g->Kp[n] + ((((int32_t)g->Kp[n+1] - g->Kp[n]) * frac) >> 8)) / (1 << GS_SHIFT);
+c->Ki = (float)(g->Ki[n] + ((((int32_t)g->Ki[n+1] - g->Ki[n]) * frac) >> 8)) / (1 << GS_SHIFT);
+c->Kd = (float)(g->Kd[n] + ((((int32_t)g->Kd[n+1] - g->Kd[n]) * frac) >> 8)) / (1 << GS_SHIFT);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        One pass of task_control() in run_pid()
+//     RETURN:             DAC code written to the AD7243
+//     NOTES:              Keep in step with task_control() line for line.
+//***************************************************************************
+static inline uint16_t pid_law_step(const struct pid_law_cfg *c,
+                                    struct pid_law_state *s, uint16_t adc)
+{
+float volts, ff = 0;
+
+if (c->ff_on)
+       {      if (c->step_ms > 0)
+                     ff = c->ff_kv * (c->tsp - s->sp_last) * 60000.0f / c->step_ms;
+              if (c->ff_kpl > 0) ff += c->tsp / c->ff_kpl;
+       }
+s->sp_last = c->tsp;
+if (s->count % R_SIZE == 0)
+       {      s->count = 0;
+              s->mvstart = s->mvfb;
+       }
+s->mvnew = pid_law_mpa(c, adc);
+pid_law_est_update(c, s, adc);
+s->mvf  = (float)(s->est_x - ((int32_t)c->lv_bits << 8)) * c->est_scale;
+s->rate = (float)s->est_v * c->est_scale;
+pid_law_smith_update(c, s);
+s->mvfb = s->mvnew + s->smith;
+if (c->est_alpha)
+       s->D = -s->rate - (s->smith - s->smith_last);
+else if (s->count == 0)
+       s->D = (s->mvstart - s->mvfb) / R_SIZE;
+s->smith_last = s->smith;
+s->integ[s->count] = c->tsp - s->mvfb;
+s->I = (s->integ[0]+s->integ[1]+s->integ[2]+s->integ[3]+s->integ[4])
+       / (R_SIZE * c->max_mpa);
+s->P = pid_law_dac_volts(s->mvfb, c->tsp, c->pb);
+if (s->P != 5 && s->P != -5)
+       {      volts = (c->Kp*s->P) + (c->Ki*s->I) + (c->Kd*s->D) + ff;
+              if (volts >  5) volts = +5;
+              if (volts < -5) volts = -5;
+       }
+else   volts = (c->Kp * s->P) + ff;   // Is outside proportional band
+
+if (volts > 5) volts = 5;
+s->volts = volts;
+s->count++;
+s->sm_dac = pid_law_dac_bits(volts);
+return(s->sm_dac);
+}
+
+#endif
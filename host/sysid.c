@@ -0,0 +1,530 @@
+//*******************************************************************
+//   Program:    sysid.c
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Fits first order plus dead time and second order plus dead time
+// models of the cell to PRBS (menu X) or step logs from the rig, one
+// set of models per gain table point, and prints the values to enter
+// in the setup (menus F and S) and the gain table (menu G).
+//
+//   Build:  gcc -O2 -pthread -o sysid sysid.c -lm
+//   Usage:  sysid [options] file.log [file.log ...]   (- = stdin)
+//           -lv/-hv n       cal.LV_BITS / HV_BITS (12000 / 60000)
+//           -max n          cal.MAX_MPA (300)
+//           -win n          Samples per fit window (500)
+//           -dmax n         Longest dead time tried in samples (40)
+//           -fit n          Least simulation fit % a window needs (50)
+//           -kp/-ki/-kd n   Gains tuned at the reference point, scaled
+//                           per point for the gain table (5 / 0.1 / 0.1)
+//           -t n            Threads (all cores)
+//           -o file.csv     Every window's fit
+//
+// Note 1: Two kinds of line are used - "PRBS,n,DAC,ADC" from
+//         prbs_test() and the run_pid() record (Count, ADC and
+//         DAC/PID). Either way sample n pairs the ADC reading with the
+//         output driven after it. A gap in n or Count starts a new
+//         segment, so run_pid() logs need LOG_EVERY 1.
+// Note 2: Each window is fitted as an ARX model with an offset term
+//         for every dead time from 0 to -dmax by least squares, the
+//         dead time kept is the one whose free run simulation follows
+//         the data best. Windows are independent, the worker threads
+//         take them from a shared counter.
+// Note 3: A window belongs to the gain table point nearest its mean
+//         pressure. Point results are means weighted by fit. Gains
+//         for points with no data are interpolated from their
+//         neighbours, Kp, Ki and Kd are scaled by the reference gain
+//         over the point gain so the loop gain stays the same.
+//*******************************************************************
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pid_law.h"
+
+#define    STEP_MS          20       // AD7705 at 50Hz, as CONTROL_MS
+#define    NP_MAX           5        // Parameters in the second order fit
+#define    MIN_U_STD        0.01     // Volts - window has no excitation
+#define    IV_PASSES        3        // Instrumental variable refinements
+
+struct SEGMENT
+{    float  *u, *y;            // Volts out, MPa in
+     size_t n, size;
+};
+
+struct WINDOW
+{    const struct SEGMENT *seg;
+     size_t start, n;
+     double ymean, umean;
+     int    point;             // Gain table point (-1 = not fitted)
+     // FOPDT  K / (tau.s + 1) . e^-sL
+     double K1, tau, L1, fit1;
+     // SOPDT  K.wn^2 / (s^2 + 2.zeta.wn.s + wn^2) . e^-sL
+     double K2, wn, zeta, L2, fit2;
+};
+
+static struct
+{    struct pid_law_cfg cfg;
+     struct SEGMENT *seg;
+     size_t nseg;
+     struct WINDOW *win;
+     size_t nwin, next;
+     size_t win_n;
+     unsigned dmax;
+     double min_fit;
+     long   lines, samples;
+}    id ;
+
+//***************************************************************************
+//     DESCRIPTION:        Solve the normal equations A.x = b in place
+//     RETURN:             0, or -1 if A is singular
+//     NOTES:              Gaussian elimination with partial pivoting, n is
+//                         at most NP_MAX so nothing cleverer is needed.
+//***************************************************************************
+static int solve(double A[NP_MAX][NP_MAX], double *b, double *x, int n)
+{
+int i, j, k, p;
+double t;
+
+for (k = 0; k < n; k++)
+       {      for (p = k, i = k + 1; i < n; i++)
+                     if (fabs(A[i][k]) > fabs(A[p][k])) p = i;
+              if (fabs(A[p][k]) < 1e-12) return(-1);
+              if (p != k)
+                     {      for (j = 0; j < n; j++) t = A[k][j], A[k][j] = A[p][j], A[p][j] = t;
+                            t = b[k], b[k] = b[p], b[p] = t;
+                     }
+              for (i = k + 1; i < n; i++)
+                     {      t = A[i][k] / A[k][k];
+                            for (j = k; j < n; j++) A[i][j] -= t * A[k][j];
+                            b[i] -= t * b[k];
+                     }
+       }
+for (k = n - 1; k >= 0; k--)
+       {      for (t = b[k], j = k + 1; j < n; j++) t -= A[k][j] * x[j];
+              x[k] = t / A[k][k];
+       }
+return(0);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Regressors for sample k of a window
+//     RETURN:             Number of parameters (3 first order, 5 second)
+//     NOTES:              y(k) = a1.y(k-1) [+ a2.y(k-2)] + b1.u(k-1-d)
+//                         [+ b2.u(k-2-d)] + c
+//***************************************************************************
+static int regressors(const float *y, const float *u, size_t k, unsigned d,
+                      int order, double *phi)
+{
+if (order == 1)
+       {      phi[0] = y[k - 1];
+              phi[1] = u[k - 1 - d];
+              phi[2] = 1;
+              return(3);
+       }
+phi[0] = y[k - 1];
+phi[1] = y[k - 2];
+phi[2] = u[k - 1 - d];
+phi[3] = u[k - 2 - d];
+phi[4] = 1;
+return(5);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Free run simulation of a fitted model
+//     RETURN:             Fit % (100 = exact), -HUGE_VAL if it diverged
+//     NOTES:              Starts from the measured samples before k0 and
+//                         then only sees u, so a model that only predicts
+//                         one sample ahead scores badly.
+//***************************************************************************
+static double simulate(const float *y, const float *u, size_t n, size_t k0,
+                       unsigned d, int order, const double *th, float *ys)
+{
+double e, v, se = 0, sy = 0, mean = 0;
+size_t k;
+
+memcpy(ys, y, k0 * sizeof(*ys));
+for (k = k0; k < n; k++)
+       {      if (order == 1) v = th[0] * ys[k - 1] + th[1] * u[k - 1 - d] + th[2];
+              else            v = th[0] * ys[k - 1] + th[1] * ys[k - 2]
+                                  + th[2] * u[k - 1 - d] + th[3] * u[k - 2 - d] + th[4];
+              if (!isfinite(v) || fabs(v) > 1e6) return(-HUGE_VAL);
+              ys[k] = (float)v;
+              mean += y[k];
+       }
+mean /= n - k0;
+for (k = k0; k < n; k++)
+       {      e = y[k] - ys[k];
+              se += e * e;
+              sy += (y[k] - mean) * (y[k] - mean);
+       }
+if (sy <= 0) return(-HUGE_VAL);
+return(100 * (1 - sqrt(se / sy)));
+}
+
+//***************************************************************************
+//     DESCRIPTION:        ARX fit by least squares then instrumental variables
+//     RETURN:             Fit % of the better estimate, -HUGE_VAL if none
+//     NOTES:              Plain least squares is biased by sensor noise on
+//                         the past outputs, badly so for the second order
+//                         model with poles this close to 1. The simulated
+//                         output of the last estimate is noise free and
+//                         is used as the instrument for the next one.
+//***************************************************************************
+static double fit_arx(const float *y, const float *u, size_t n, size_t k0,
+                      unsigned d, int order, double *th, float *ys)
+{
+double A[NP_MAX][NP_MAX], b[NP_MAX], phi[NP_MAX], z[NP_MAX], est[NP_MAX];
+double f, best = -HUGE_VAL;
+size_t k;
+int i, j, np = 0, pass;
+
+for (pass = 0; pass < IV_PASSES + 1; pass++)
+       {      memset(A, 0, sizeof(A));
+              memset(b, 0, sizeof(b));
+              for (k = k0; k < n; k++)
+                     {      np = regressors(y, u, k, d, order, phi);
+                            if (pass) regressors(ys, u, k, d, order, z);
+                            else      memcpy(z, phi, sizeof(z));
+                            for (i = 0; i < np; i++)
+                                   {      for (j = 0; j < np; j++) A[i][j] += z[i] * phi[j];
+                                          b[i] += z[i] * y[k];
+                                   }
+                     }
+              if (solve(A, b, est, np)) break;
+              if ((f = simulate(y, u, n, k0, d, order, est, ys)) == -HUGE_VAL) break;
+              if (f > best)
+                     {      best = f;
+                            memcpy(th, est, np * sizeof(*th));
+                     }
+       }
+return(best);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Discrete first order model to K, tau
+//     RETURN:             0, or -1 if the pole is not a stable lag
+//***************************************************************************
+static int to_fopdt(const double *th, double T, struct WINDOW *w)
+{
+if (th[0] <= 0 || th[0] >= 1) return(-1);
+w->K1  = th[1] / (1 - th[0]);
+w->tau = -T / log(th[0]);
+return(0);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Discrete second order model to K, wn, zeta
+//     RETURN:             0, or -1 for an unstable or negative real pole
+//     NOTES:              Poles of z^2 - a1.z - a2 mapped by s = ln(z)/T.
+//***************************************************************************
+static int to_sopdt(const double *th, double T, struct WINDOW *w)
+{
+double a1 = th[0], a2 = th[1], disc = a1 * a1 + 4 * a2, r, q, z1, z2, t1, t2;
+
+if (1 - a1 - a2 <= 0) return(-1);
+w->K2 = (th[2] + th[3]) / (1 - a1 - a2);
+if (disc < 0)
+       {      r = sqrt(-a2);                       // |z|
+              q = atan2(sqrt(-disc) / 2, a1 / 2);  // arg z
+              if (r >= 1) return(-1);
+              w->wn   = sqrt(log(r) * log(r) + q * q) / T;
+              w->zeta = -log(r) / (T * w->wn);
+              return(0);
+       }
+z1 = (a1 + sqrt(disc)) / 2;
+z2 = (a1 - sqrt(disc)) / 2;
+if (z2 <= 0 && z2 > -0.5) z2 = 1e-3;        // Lag under a sample, first order
+if (z1 <= 0 || z1 >= 1 || z2 <= 0 || z2 >= 1) return(-1);
+t1 = -T / log(z1);
+t2 = -T / log(z2);
+w->wn   = 1 / sqrt(t1 * t2);
+w->zeta = (t1 + t2) / (2 * sqrt(t1 * t2));
+return(0);
+}
+
+static void fit_window(struct WINDOW *w, float *ys)
+{
+const float *y = w->seg->y + w->start, *u = w->seg->u + w->start;
+double th[NP_MAX], best[NP_MAX] = {0}, f, su = 0, T = STEP_MS / 1000.0;
+size_t k, k0 = id.dmax + 2;
+unsigned d, dbest;
+
+w->point = -1;
+w->fit1 = w->fit2 = -HUGE_VAL;
+for (k = 0, w->ymean = w->umean = 0; k < w->n; k++) w->ymean += y[k], w->umean += u[k];
+w->ymean /= w->n;
+w->umean /= w->n;
+for (k = 0; k < w->n; k++) su += (u[k] - w->umean) * (u[k] - w->umean);
+if (sqrt(su / w->n) < MIN_U_STD || w->n < 4 * k0) return;
+
+for (d = 0, dbest = 0; d <= id.dmax; d++)
+       if ((f = fit_arx(y, u, w->n, k0, d, 1, th, ys)) > w->fit1)
+              {      w->fit1 = f;
+                     dbest = d;
+                     memcpy(best, th, sizeof(th));
+              }
+if (w->fit1 > -HUGE_VAL && to_fopdt(best, T, w) == 0)
+       w->L1 = (dbest + 0.5) * T;           // Sample and hold adds half a step
+else   w->fit1 = -HUGE_VAL;
+
+for (d = 0, dbest = 0; d <= id.dmax; d++)
+       if ((f = fit_arx(y, u, w->n, k0, d, 2, th, ys)) > w->fit2)
+              {      w->fit2 = f;
+                     dbest = d;
+                     memcpy(best, th, sizeof(th));
+              }
+if (w->fit2 > -HUGE_VAL && to_sopdt(best, T, w) == 0)
+       w->L2 = (dbest + 0.5) * T;
+else   w->fit2 = -HUGE_VAL;
+
+if (w->fit1 >= id.min_fit || w->fit2 >= id.min_fit)
+       {      f = w->ymean / id.cfg.max_mpa * (GS_POINTS - 1) + 0.5;
+              w->point = f < 0 ? 0 : f > GS_POINTS - 1 ? GS_POINTS - 1 : (int)f;
+       }
+}
+
+static void *worker(void *arg)
+{
+size_t i;
+float *ys = malloc(2 * id.win_n * sizeof(*ys));    // Longest window
+
+(void)arg;
+while ((i = __atomic_fetch_add(&id.next, 1, __ATOMIC_RELAXED)) < id.nwin)
+       fit_window(&id.win[i], ys);
+free(ys);
+return(NULL);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Number after key in line, as printed by CCS
+//     RETURN:             1 if found
+//***************************************************************************
+static int get_field(const char *line, const char *key, double *v)
+{
+const char *p = strstr(line, key);
+char *end;
+
+if (!p) return(0);
+*v = strtod(p + strlen(key), &end);
+return(end != p + strlen(key));
+}
+
+static struct SEGMENT *new_segment(void)
+{
+struct SEGMENT *s;
+
+if (id.nseg && id.seg[id.nseg - 1].n == 0) return(&id.seg[id.nseg - 1]);
+id.seg = realloc(id.seg, (id.nseg + 1) * sizeof(*id.seg));
+s = &id.seg[id.nseg++];
+memset(s, 0, sizeof(*s));
+return(s);
+}
+
+static void add_sample(struct SEGMENT *s, double u, double y)
+{
+if (s->n == s->size)
+       {      s->size = s->size ? 2 * s->size : 4096;
+              s->u = realloc(s->u, s->size * sizeof(float));
+              s->y = realloc(s->y, s->size * sizeof(float));
+       }
+s->u[s->n]   = (float)u;
+s->y[s->n++] = (float)y;
+id.samples++;
+}
+
+static void read_log(FILE *fp)
+{
+char line[512];
+double n, dac, adc, volts;
+long last = -2;
+struct SEGMENT *s = new_segment();
+
+while (fgets(line, sizeof(line), fp))
+       {      id.lines++;
+              if (!strncmp(line, "PRBS start", 10) || !strncmp(line, "PRBS end", 8))
+                     {      s = new_segment();
+                            last = -2;
+                            continue;
+                     }
+              if (!strncmp(line, "PRBS,", 5)
+                  && sscanf(line + 5, "%lf,%lf,%lf", &n, &dac, &adc) == 3)
+                     volts = pid_law_dac_to_volts((uint16_t)dac);
+              else if (!get_field(line, "Count:", &n) || !get_field(line, "ADC:", &adc)
+                  || !get_field(line, "DAC/PID:", &volts))
+                     continue;
+              if ((long)n != ((last + 1) & 0xffff) && last != -2) s = new_segment();
+              last = (long)n;
+              add_sample(s, volts, pid_law_mpa(&id.cfg, (float)adc));
+       }
+}
+
+static void make_windows(void)
+{
+size_t i, j, n;
+
+for (i = 0; i < id.nseg; i++)
+       for (j = 0; j < id.seg[i].n; j += n)
+              {      n = id.seg[i].n - j;
+                     if (n >= 2 * id.win_n) n = id.win_n;   // Short tail joins the last
+                     if (n < id.win_n / 2) break;
+                     id.win = realloc(id.win, (id.nwin + 1) * sizeof(*id.win));
+                     memset(&id.win[id.nwin], 0, sizeof(*id.win));
+                     id.win[id.nwin].seg = &id.seg[i];
+                     id.win[id.nwin].start = j;
+                     id.win[id.nwin++].n = n;
+              }
+}
+
+int main(int argc, char **argv)
+{
+int threads = (int)sysconf(_SC_NPROCESSORS_ONLN), a, p, files = 0, q;
+const char *csv = NULL;
+pthread_t *tid;
+FILE *fp;
+size_t i;
+double Kp = 5.0, Ki = 0.1, Kd = 0.1, sw, w, kref = 0, wref = 0, s;
+double pt[GS_POINTS][8], kpt[GS_POINTS];
+int    nw[GS_POINTS];
+
+id.cfg.lv_bits = 12000; id.cfg.hv_bits = 60000; id.cfg.max_mpa = 300;
+id.win_n = 500;
+id.dmax = 40;
+id.min_fit = 50;
+
+for (a = 1; a < argc && argv[a][0] == '-' && argv[a][1]; a++)
+       {      const char *v = (a + 1 < argc) ? argv[a + 1] : "0";
+              if      (!strcmp(argv[a], "-lv"))   id.cfg.lv_bits = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-hv"))   id.cfg.hv_bits = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-max"))  id.cfg.max_mpa = strtof(v, NULL), a++;
+              else if (!strcmp(argv[a], "-win"))  id.win_n = strtoul(v, NULL, 0), a++;
+              else if (!strcmp(argv[a], "-dmax")) id.dmax = strtoul(v, NULL, 0), a++;
+              else if (!strcmp(argv[a], "-fit"))  id.min_fit = strtod(v, NULL), a++;
+              else if (!strcmp(argv[a], "-kp"))   Kp = strtod(v, NULL), a++;
+              else if (!strcmp(argv[a], "-ki"))   Ki = strtod(v, NULL), a++;
+              else if (!strcmp(argv[a], "-kd"))   Kd = strtod(v, NULL), a++;
+              else if (!strcmp(argv[a], "-t"))    threads = atoi(v), a++;
+              else if (!strcmp(argv[a], "-o"))    csv = v, a++;
+              else   {      fprintf(stderr, "sysid: unknown option %s\n", argv[a]);
+                            return(2);
+                     }
+       }
+if (threads < 1) threads = 1;
+if (id.dmax >= SMITH_RING) id.dmax = SMITH_RING - 1;   // Longest the firmware can use
+if (id.win_n < 8 * (id.dmax + 2))
+       {      fprintf(stderr, "sysid: -win needs at least %u samples for -dmax %u\n",
+                      8 * (id.dmax + 2), id.dmax);
+              return(2);
+       }
+for (; a < argc; a++, files++)
+       {      fp = strcmp(argv[a], "-") ? fopen(argv[a], "r") : stdin;
+              if (!fp)
+                     {      perror(argv[a]);
+                            return(1);
+                     }
+              new_segment();                       // Never join two files
+              read_log(fp);
+              if (fp != stdin) fclose(fp);
+       }
+if (!files) read_log(stdin);
+make_windows();
+printf("Read : %ld lines, %ld samples, %zu segments, %zu windows of %zu\n",
+       id.lines, id.samples, id.nseg, id.nwin, id.win_n);
+if (!id.nwin) return(1);
+
+tid = calloc(threads, sizeof(*tid));
+for (a = 0; a < threads; a++) pthread_create(&tid[a], NULL, worker, NULL);
+for (a = 0; a < threads; a++) pthread_join(tid[a], NULL);
+
+if (csv && (fp = fopen(csv, "w")))
+       {      fprintf(fp, "window,start,samples,mpa,volts,point,K1,tau_s,L1_ms,fit1,"
+                          "K2,wn,zeta,L2_ms,fit2\n");
+              for (i = 0; i < id.nwin; i++)
+                     {      struct WINDOW *x = &id.win[i];
+                            fprintf(fp, "%zu,%zu,%zu,%.3f,%.4f,%d,%.5g,%.5g,%.1f,%.1f,"
+                                    "%.5g,%.5g,%.4g,%.1f,%.1f\n", i, x->start, x->n,
+                                    x->ymean, x->umean, x->point,
+                                    x->fit1 > -HUGE_VAL ? x->K1 : NAN, x->tau, x->L1 * 1000, x->fit1,
+                                    x->fit2 > -HUGE_VAL ? x->K2 : NAN, x->wn, x->zeta, x->L2 * 1000, x->fit2);
+                     }
+              fclose(fp);
+       }
+
+// Fit weighted means per point, FOPDT in 0..3 and SOPDT in 4..7
+memset(pt, 0, sizeof(pt));
+memset(nw, 0, sizeof(nw));
+for (p = 0; p < GS_POINTS; p++)
+       {      for (i = 0, sw = 0; i < id.nwin; i++)
+                     {      struct WINDOW *x = &id.win[i];
+                            if (x->point != p || x->fit1 < id.min_fit) continue;
+                            w = x->fit1;
+                            pt[p][0] += w * x->K1;  pt[p][1] += w * x->tau;
+                            pt[p][2] += w * x->L1;  pt[p][3] += w * x->fit1;
+                            sw += w;
+                            nw[p]++;
+                     }
+              for (q = 0; q < 4 && sw > 0; q++) pt[p][q] /= sw;
+              kref += sw * pt[p][0];
+              wref += sw;
+              for (i = 0, sw = 0; i < id.nwin; i++)
+                     {      struct WINDOW *x = &id.win[i];
+                            if (x->point != p || x->fit2 < id.min_fit) continue;
+                            w = x->fit2;
+                            pt[p][4] += w * x->K2;  pt[p][5] += w * x->wn;
+                            pt[p][6] += w * x->zeta;  pt[p][7] += w * x->fit2;
+                            sw += w;
+                     }
+              for (q = 4; q < 8 && sw > 0; q++) pt[p][q] /= sw;
+       }
+if (wref <= 0)
+       {      printf("No window fitted better than %.0f%%, more excitation needed\n", id.min_fit);
+              return(1);
+       }
+kref /= wref;
+
+printf("\nPoint   MPa  Win   K MPa/V   tau s  dead ms   fit%%"
+       "  |   K MPa/V   wn r/s    zeta   fit%%\n");
+for (p = 0; p < GS_POINTS; p++)
+       {      printf("%5d %5.1f %4d", p, id.cfg.max_mpa * p / (GS_POINTS - 1), nw[p]);
+              if (nw[p]) printf("  %8.4f %7.3f %8.0f %6.1f", pt[p][0], pt[p][1],
+                                pt[p][2] * 1000, pt[p][3]);
+              else       printf("  %8s %7s %8s %6s", "-", "-", "-", "-");
+              if (pt[p][7] > 0) printf("  |  %8.4f %8.3f %7.3f %6.1f\n",
+                                       pt[p][4], pt[p][5], pt[p][6], pt[p][7]);
+              else       printf("  |  %8s %8s %7s %6s\n", "-", "-", "-", "-");
+       }
+
+// Plant gain per point, points with no data from the nearest each side
+for (p = 0; p < GS_POINTS; p++)
+       {      int lo, hi;
+              if (nw[p]) { kpt[p] = pt[p][0]; continue; }
+              for (lo = p - 1; lo >= 0 && !nw[lo]; lo--) ;
+              for (hi = p + 1; hi < GS_POINTS && !nw[hi]; hi++) ;
+              if (lo < 0)               kpt[p] = pt[hi][0];
+              else if (hi >= GS_POINTS) kpt[p] = pt[lo][0];
+              else kpt[p] = pt[lo][0] + (pt[hi][0] - pt[lo][0]) * (p - lo) / (hi - lo);
+       }
+
+for (p = 0, sw = 0, s = 0, w = 0; p < GS_POINTS; p++)
+       if (nw[p])
+              {      s  += pt[p][3] * pt[p][1];
+                     w  += pt[p][3] * pt[p][2];
+                     sw += pt[p][3];
+              }
+printf("\nSetup (all points, K %.4f MPa/V):\n", kref);
+printf("  F - Plant gain (MPa/V)             : %.4f\n", kref);
+printf("  S - Model gain, time constant, dead: %.4f  %.3f s  %.0f ms\n",
+       kref, s / sw, w / sw * 1000);
+printf("\nGain table (menu G, Kp %.3f Ki %.3f Kd %.3f at K %.4f):\n", Kp, Ki, Kd, kref);
+for (p = 0; p < GS_POINTS; p++)
+       {      s = kpt[p] > 0 ? kref / kpt[p] : 1;
+              printf("  %d,%.3f,%.3f,%.3f\n", p, fmin(Kp * s, 63.99),
+                     fmin(Ki * s, 63.99), fmin(Kd * s, 63.99));
+       }
+return(0);
+}
@@ -0,0 +1,656 @@
+//*******************************************************************
+//   Program:    telemd.c
+//   Author:     R.Aspey
+//   Compiler:   gcc (host side, C99)
+//
+// Soak test logger. Reads the run_pid() console records from the
+// serial port (or a pty standing in for it), keeps rolling error RMS,
+// DAC duty and RPM percentiles, and appends every record to a chunked
+// columnar file that can be queried by time range afterwards.
+//
+//   Build:  gcc -O2 -o telemd telemd.c -lm
+//   Usage:  telemd [options] file.tlm              Record
+//           telemd -q t0 t1 [-csv] file.tlm        Query ms range
+//           telemd -i file.tlm                     Show the index
+//           -d dev          Serial device or pty (/dev/ttyUSB0, - = stdin)
+//           -b baud         115200 (ignored for a pty or pipe)
+//           -w s            Rolling window for the statistics (60)
+//           -s s            Seconds between status lines (10)
+//           -D              Run as a daemon, status lines to syslog (not
+//                           with -d -, the daemon has no stdin)
+//
+// Note 1: The firmware sends "\r\n" at the start of a record, so a
+//         record is parsed when the next line break arrives. Skipped
+//         records print '.', which the number parser stops at, and a
+//         gap in Count is kept as the dropped count of the chunk the
+//         next record lands in (held until that chunk is mapped when
+//         the last one has just filled).
+// Note 2: File layout - one 4K header page, then chunks of CHUNK_ROWS
+//         rows. A chunk is a 64 byte head (first and last time, rows)
+//         then one array per column. Chunks are in time order so the
+//         head times are the time index, a query binary searches them
+//         and maps one chunk at a time. The row count is written last,
+//         a crash loses at most the row being written.
+// Note 3: Times are host CLOCK_REALTIME in ms at the end of the line,
+//         kept non-decreasing in the file if the clock steps back.
+// Note 4: Memory is bounded - the writer maps only the current chunk,
+//         the window is a fixed ring and the RPM percentiles come
+//         from a 1 RPM histogram the ring adds to and takes from.
+//*******************************************************************
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define    TLM_MAGIC        0x314d4c54    // "TLM1"
+#define    TLM_VERSION      1
+#define    PAGE             4096
+#define    CHUNK_ROWS       4096
+#define    CHUNK_HEAD       64
+#define    LINE_MAX_LEN     256
+#define    RPM_BINS         8192
+#define    RECORD_HZ        50            // Most the rig sends (LOG_EVERY 1)
+#define    VOLTS_MAX        5.0f
+
+// Float columns, in the order they are stored
+enum { C_SP, C_MV, C_VOLTS, C_ERR, C_P, C_I, C_D, C_RPM, FCOLS };
+static const char *fname[FCOLS] = { "sp", "mv", "volts", "err", "P", "I", "D", "rpm" };
+
+struct tlm_header
+{    uint32_t magic, version;
+     uint32_t chunk_rows, chunk_bytes;
+     uint32_t fcols;
+     char     names[FCOLS][8];
+};
+
+struct chunk_head
+{    int64_t  t_first, t_last;    // ms, valid when rows > 0
+     uint32_t rows;
+     uint32_t dropped;            // Records missing from Count
+     uint8_t  spare[CHUNK_HEAD - 24];
+};
+
+struct CHUNK
+{    uint8_t  *base;
+     struct chunk_head *h;
+     int64_t  *t;
+     float    *f[FCOLS];
+     uint16_t *count, *adc;
+};
+
+struct RECORD
+{    int64_t  t;
+     float    f[FCOLS];
+     uint16_t count, adc;
+};
+
+struct ACC                        // Sums for error RMS, duty and RPM
+{    long     n, sat;
+     double   e2, duty;
+     uint32_t hist[RPM_BINS];
+};
+
+static struct
+{    int      fd;                 // Data file
+     size_t   chunks;
+     struct CHUNK cur;
+     int64_t  t_last;
+     long     rows, dropped, bad;
+     int      have_count;
+     uint16_t last_count;
+     uint32_t gap_pending;        // Dropped, waiting for a chunk
+     struct RECORD *ring;         // Rolling window
+     size_t   ring_n, ring_head, ring_used;
+     int64_t  window_ms;
+     struct ACC acc;
+     int      daemon;
+}    tl ;
+
+static volatile sig_atomic_t stop;
+
+static size_t chunk_bytes(void)
+{
+size_t n = CHUNK_HEAD + CHUNK_ROWS * (sizeof(int64_t) + FCOLS * sizeof(float)
+                                      + 2 * sizeof(uint16_t));
+return((n + PAGE - 1) / PAGE * PAGE);
+}
+
+static off_t chunk_offset(size_t i)
+{
+return((off_t)PAGE + (off_t)i * chunk_bytes());
+}
+
+static void chunk_bind(struct CHUNK *c, uint8_t *base)
+{
+uint8_t *p = base + CHUNK_HEAD;
+int i;
+
+c->base = base;
+c->h = (struct chunk_head *)base;
+c->t = (int64_t *)p;            p += CHUNK_ROWS * sizeof(int64_t);
+for (i = 0; i < FCOLS; i++)
+       {      c->f[i] = (float *)p;
+              p += CHUNK_ROWS * sizeof(float);
+       }
+c->count = (uint16_t *)p;       p += CHUNK_ROWS * sizeof(uint16_t);
+c->adc   = (uint16_t *)p;
+}
+
+static int chunk_map(struct CHUNK *c, int fd, size_t i, int prot)
+{
+void *m = mmap(NULL, chunk_bytes(), prot, MAP_SHARED, fd, chunk_offset(i));
+
+if (m == MAP_FAILED) return(-1);
+chunk_bind(c, m);
+return(0);
+}
+
+static void chunk_unmap(struct CHUNK *c)
+{
+if (c->base) munmap(c->base, chunk_bytes());
+c->base = NULL;
+}
+
+static int64_t now_ms(void)
+{
+struct timespec t;
+
+clock_gettime(CLOCK_REALTIME, &t);
+return((int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000);
+}
+
+static void say(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void say(const char *fmt, ...)
+{
+va_list ap;
+
+va_start(ap, fmt);
+if (tl.daemon) vsyslog(LOG_INFO, fmt, ap);
+else           { vprintf(fmt, ap); putchar('\n'); fflush(stdout); }
+va_end(ap);
+}
+
+static int header_ok(const char *name)
+{
+struct tlm_header h;
+
+if (pread(tl.fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == TLM_MAGIC
+    && h.version == TLM_VERSION && h.chunk_rows == CHUNK_ROWS
+    && h.chunk_bytes == chunk_bytes() && h.fcols == FCOLS)
+       return(1);
+fprintf(stderr, "telemd: %s is not a version %d data file\n", name, TLM_VERSION);
+return(0);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Open or create the data file for appending
+//     RETURN:             0, -1 on error
+//     NOTES:              A chunk left part full by the last run is filled.
+//***************************************************************************
+static int file_open(const char *name)
+{
+struct tlm_header h;
+struct stat sb;
+int i;
+
+tl.fd = open(name, O_RDWR | O_CREAT, 0644);
+if (tl.fd < 0 || fstat(tl.fd, &sb)) { perror(name); return(-1); }
+if (sb.st_size == 0)
+       {      memset(&h, 0, sizeof(h));
+              h.magic = TLM_MAGIC;
+              h.version = TLM_VERSION;
+              h.chunk_rows = CHUNK_ROWS;
+              h.chunk_bytes = chunk_bytes();
+              h.fcols = FCOLS;
+              for (i = 0; i < FCOLS; i++) strncpy(h.names[i], fname[i], sizeof(h.names[i]) - 1);
+              if (pwrite(tl.fd, &h, sizeof(h), 0) != sizeof(h) || ftruncate(tl.fd, PAGE))
+                     { perror(name); return(-1); }
+              sb.st_size = PAGE;
+       }
+else if (!header_ok(name))
+       return(-1);
+tl.chunks = (sb.st_size - PAGE) / chunk_bytes();
+if (tl.chunks)
+       {      if (chunk_map(&tl.cur, tl.fd, tl.chunks - 1, PROT_READ | PROT_WRITE))
+                     { perror(name); return(-1); }
+              if (tl.cur.h->rows) tl.t_last = tl.cur.h->t_last;
+              if (tl.cur.h->rows >= CHUNK_ROWS) chunk_unmap(&tl.cur);
+       }
+return(0);
+}
+
+static int chunk_new(void)
+{
+if (tl.cur.base)
+       {      msync(tl.cur.base, chunk_bytes(), MS_ASYNC);
+              chunk_unmap(&tl.cur);
+       }
+if (ftruncate(tl.fd, chunk_offset(tl.chunks + 1))) return(-1);
+if (chunk_map(&tl.cur, tl.fd, tl.chunks, PROT_READ | PROT_WRITE)) return(-1);
+tl.chunks++;
+tl.cur.h->dropped += tl.gap_pending;
+tl.gap_pending = 0;
+return(0);
+}
+
+static int append(const struct RECORD *r)
+{
+struct chunk_head *h;
+uint32_t n;
+int i;
+
+if (!tl.cur.base && chunk_new())
+       {      say("telemd: cannot extend the data file: %s", strerror(errno));
+              return(-1);
+       }
+h = tl.cur.h;
+n = h->rows;
+tl.cur.t[n] = r->t;
+for (i = 0; i < FCOLS; i++) tl.cur.f[i][n] = r->f[i];
+tl.cur.count[n] = r->count;
+tl.cur.adc[n]   = r->adc;
+if (n == 0) h->t_first = r->t;
+h->t_last = r->t;
+__atomic_store_n(&h->rows, n + 1, __ATOMIC_RELEASE);   // Commits the row
+if (n + 1 == CHUNK_ROWS)
+       {      msync(tl.cur.base, chunk_bytes(), MS_ASYNC);
+              chunk_unmap(&tl.cur);
+       }
+return(0);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Add (sign 1) or take away (sign -1) a record
+//     RETURN:             None
+//***************************************************************************
+static void acc_add(struct ACC *a, const struct RECORD *r, int sign)
+{
+float v = fabsf(r->f[C_VOLTS]);
+long  bin = lrintf(r->f[C_RPM]);
+
+if (bin < 0) bin = 0;
+if (bin >= RPM_BINS) bin = RPM_BINS - 1;
+a->n    += sign;
+a->e2   += sign * (double)r->f[C_ERR] * r->f[C_ERR];
+a->duty += sign * (double)v / VOLTS_MAX;
+a->sat  += sign * (v >= VOLTS_MAX - 0.01f);
+a->hist[bin] += sign;
+}
+
+static void acc_percentiles(const struct ACC *a, const double *q, int nq, long *out)
+{
+long seen = 0, k;
+int j = 0;
+
+for (k = 0; k < RPM_BINS && j < nq; k++)
+       {      seen += a->hist[k];
+              while (j < nq && seen > 0 && seen >= q[j] * a->n) out[j++] = k;
+       }
+while (j < nq) out[j++] = 0;
+}
+
+static void acc_show(const char *tag, const struct ACC *a)
+{
+static const double q[3] = { 0.50, 0.95, 0.99 };
+long p[3];
+
+if (a->n <= 0)
+       {      say("%s: no records", tag);
+              return;
+       }
+acc_percentiles(a, q, 3, p);
+say("%s: %ld records, error RMS %.4f MPa, DAC duty %.1f%% (at limit %.1f%%), "
+    "RPM p50 %ld p95 %ld p99 %ld", tag, a->n, sqrt(fabs(a->e2) / a->n),
+    100 * a->duty / a->n, 100.0 * a->sat / a->n, p[0], p[1], p[2]);
+}
+
+static void window_add(const struct RECORD *r)
+{
+size_t tail;
+
+while (tl.ring_used)                  // Drop what has left the window
+       {      tail = (tl.ring_head + tl.ring_n - tl.ring_used) % tl.ring_n;
+              if (tl.ring_used < tl.ring_n && r->t - tl.ring[tail].t < tl.window_ms) break;
+              acc_add(&tl.acc, &tl.ring[tail], -1);
+              tl.ring_used--;
+       }
+tl.ring[tl.ring_head] = *r;
+tl.ring_head = (tl.ring_head + 1) % tl.ring_n;
+tl.ring_used++;
+acc_add(&tl.acc, r, 1);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Fixed point decimal as printed by CCS "%f"
+//     RETURN:             Value, *pp moved past it. NAN if no digits.
+//     NOTES:              Stops at the second '.' (see note 1).
+//***************************************************************************
+static float get_num(const char **pp, const char *end)
+{
+const char *p = *pp;
+double v = 0, scale = 1;
+int neg = 0, digits = 0;
+
+while (p < end && *p == ' ') p++;
+if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0'), digits++;
+if (p < end && *p == '.')
+       {      p++;
+              while (p < end && *p >= '0' && *p <= '9')
+                     scale *= 0.1, v += (*p++ - '0') * scale, digits++;
+       }
+*pp = p;
+if (!digits) return(NAN);
+return((float)(neg ? -v : v));
+}
+
+static float get_field(const char **pp, const char *end, const char *key)
+{
+const char *p = memmem(*pp, end - *pp, key, strlen(key));
+
+if (!p) return(NAN);
+*pp = p + strlen(key);
+return(get_num(pp, end));
+}
+
+static int parse_record(const char *p, const char *end, struct RECORD *r)
+{
+float v;
+
+if (isnan(v = get_field(&p, end, "Count:"))) return(0);
+r->count = (uint16_t)v;
+r->f[C_SP] = get_field(&p, end, "SP:");
+r->f[C_MV] = get_field(&p, end, "MV:");
+if (isnan(v = get_field(&p, end, "ADC:"))) return(0);
+r->adc = (uint16_t)v;
+r->f[C_VOLTS] = get_field(&p, end, "DAC/PID:");
+r->f[C_ERR]   = get_field(&p, end, "ERR:");
+r->f[C_P]     = get_field(&p, end, "(P:");
+r->f[C_I]     = get_field(&p, end, "I:");
+r->f[C_D]     = get_field(&p, end, "D:");
+r->f[C_RPM]   = get_field(&p, end, "RPM:");
+return(!isnan(r->f[C_SP]) && !isnan(r->f[C_VOLTS]) && !isnan(r->f[C_RPM]));
+}
+
+static void line_done(const char *p, size_t n)
+{
+struct RECORD r;
+uint16_t gap;
+
+if (n < 6 || !memmem(p, n, "Count:", 6)) return;
+if (!parse_record(p, p + n, &r))
+       {      tl.bad++;
+              return;
+       }
+r.t = now_ms();
+if (r.t < tl.t_last) r.t = tl.t_last;      // Keep the index sorted
+tl.t_last = r.t;
+if (tl.have_count)
+       {      gap = r.count - tl.last_count;
+              if (gap > 1 && gap < 0x8000)       // Not a restart of the loop
+                     {      tl.dropped += gap - 1;
+                            if (tl.cur.base) tl.cur.h->dropped += gap - 1;
+                            else tl.gap_pending += gap - 1;
+                     }
+       }
+tl.have_count = 1;
+tl.last_count = r.count;
+if (append(&r) == 0) tl.rows++;
+window_add(&r);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        Feed received bytes to the line splitter
+//     RETURN:             None
+//     NOTES:              Keeps the part line between calls, a line that
+//                         is too long is thrown away up to the next break.
+//                         b NULL ends the part line - the last record is
+//                         not followed by a break until the next one.
+//***************************************************************************
+static void feed(const char *b, size_t n)
+{
+static char line[LINE_MAX_LEN];
+static size_t len;
+static int junk;
+size_t i;
+
+if (!b)
+       {      if (!junk && len) line_done(line, len);
+              len = 0;
+              junk = 0;
+              return;
+       }
+for (i = 0; i < n; i++)
+       {      if (b[i] == '\r' || b[i] == '\n')
+                     {      if (!junk && len) line_done(line, len);
+                            len = 0;
+                            junk = 0;
+                     }
+              else if (len < sizeof(line)) line[len++] = b[i];
+              else   junk = 1;
+       }
+}
+
+static speed_t baud_code(long baud)
+{
+switch (baud)
+       {      case 9600:   return(B9600);
+              case 19200:  return(B19200);
+              case 38400:  return(B38400);
+              case 57600:  return(B57600);
+              case 115200: return(B115200);
+              case 230400: return(B230400);
+       }
+return(B0);
+}
+
+static int open_port(const char *dev, long baud)
+{
+struct termios t;
+int fd;
+
+if (!strcmp(dev, "-")) return(0);
+fd = open(dev, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+if (fd < 0) return(-1);
+if (isatty(fd) && tcgetattr(fd, &t) == 0)
+       {      cfmakeraw(&t);
+              if (baud_code(baud) != B0)
+                     {      cfsetispeed(&t, baud_code(baud));
+                            cfsetospeed(&t, baud_code(baud));
+                     }
+              t.c_cflag |= CLOCAL | CREAD;
+              tcsetattr(fd, TCSANOW, &t);
+       }
+return(fd);
+}
+
+static void on_signal(int s)
+{
+(void)s;
+stop = 1;
+}
+
+static int record(const char *dev, long baud, int status_s)
+{
+char buf[4096];
+struct pollfd pf;
+int64_t next = now_ms() + status_s * 1000LL, sync = 0;
+ssize_t got;
+int fd = -1;
+
+signal(SIGINT, on_signal);
+signal(SIGTERM, on_signal);
+signal(SIGHUP, SIG_IGN);
+say("telemd: %s -> %zu chunks, window %lld s", dev, tl.chunks, (long long)tl.window_ms / 1000);
+while (!stop)
+       {      if (fd < 0 && (fd = open_port(dev, baud)) < 0)
+                     {      sleep(1);                   // Unplugged, try again
+                            continue;
+                     }
+              pf.fd = fd;
+              pf.events = POLLIN;
+              if (poll(&pf, 1, 1000) > 0)
+                     {      got = read(fd, buf, sizeof(buf));
+                            if (got > 0) feed(buf, got);
+                            else if (got == 0 || errno != EAGAIN)
+                                   {      if (fd == 0) break;   // End of stdin
+                                          close(fd);
+                                          fd = -1;
+                                          say("telemd: %s closed, reopening", dev);
+                                          sleep(1);
+                                   }
+                     }
+              if (now_ms() >= next)
+                     {      acc_show("window", &tl.acc);
+                            say("telemd: %ld rows, %ld dropped, %ld bad lines, %zu chunks",
+                                tl.rows, tl.dropped, tl.bad, tl.chunks);
+                            next += status_s * 1000LL;
+                     }
+              if (tl.cur.base && now_ms() >= sync)
+                     {      msync(tl.cur.base, chunk_bytes(), MS_ASYNC);
+                            sync = now_ms() + 1000;
+                     }
+       }
+if (fd > 0) close(fd);
+feed(NULL, 0);                             // Last record, EOF or signal
+if (tl.cur.base)
+       {      msync(tl.cur.base, chunk_bytes(), MS_SYNC);
+              chunk_unmap(&tl.cur);
+       }
+say("telemd: stopped, %ld rows", tl.rows);
+return(0);
+}
+
+//***************************************************************************
+//     DESCRIPTION:        First chunk whose last time is at or after t
+//     RETURN:             Chunk index, tl.chunks if there is none
+//     NOTES:              Only the head page of each chunk probed is
+//                         mapped, a multi-day file takes a few page reads.
+//***************************************************************************
+static size_t chunk_find(int64_t t)
+{
+size_t lo = 0, hi = tl.chunks, mid;
+struct chunk_head *h;
+
+while (lo < hi)
+       {      mid = lo + (hi - lo) / 2;
+              h = mmap(NULL, PAGE, PROT_READ, MAP_SHARED, tl.fd, chunk_offset(mid));
+              if (h == MAP_FAILED) return(tl.chunks);
+              if (h->rows && h->t_last < t) lo = mid + 1;
+              else                          hi = mid;
+              munmap(h, PAGE);
+       }
+return(lo);
+}
+
+static int query(int64_t t0, int64_t t1, int csv, int index)
+{
+struct CHUNK c = { 0 };
+struct RECORD r;
+size_t i;
+uint32_t k, n, lo, hi;
+int j;
+
+if (csv) printf("t_ms,count,adc,%s,%s,%s,%s,%s,%s,%s,%s\n", fname[0], fname[1],
+                fname[2], fname[3], fname[4], fname[5], fname[6], fname[7]);
+for (i = index ? 0 : chunk_find(t0); i < tl.chunks; i++)
+       {      if (chunk_map(&c, tl.fd, i, PROT_READ)) { perror("mmap"); return(1); }
+              n = __atomic_load_n(&c.h->rows, __ATOMIC_ACQUIRE);
+              if (index)
+                     {      printf("chunk %zu: %u rows, %lld to %lld ms, %u dropped\n", i, n,
+                                   (long long)c.h->t_first, (long long)c.h->t_last, c.h->dropped);
+                            chunk_unmap(&c);
+                            continue;
+                     }
+              if (!n || c.h->t_first > t1) { chunk_unmap(&c); break; }
+              for (lo = 0, hi = n; lo < hi; )     // First row at or after t0
+                     {      k = lo + (hi - lo) / 2;
+                            if (c.t[k] < t0) lo = k + 1; else hi = k;
+                     }
+              for (k = lo; k < n && c.t[k] <= t1; k++)
+                     {      r.t = c.t[k];
+                            for (j = 0; j < FCOLS; j++) r.f[j] = c.f[j][k];
+                            r.count = c.count[k];
+                            r.adc = c.adc[k];
+                            acc_add(&tl.acc, &r, 1);
+                            if (!csv) continue;
+                            printf("%lld,%u,%u", (long long)r.t, r.count, r.adc);
+                            for (j = 0; j < FCOLS; j++) printf(",%g", r.f[j]);
+                            putchar('\n');
+                     }
+              chunk_unmap(&c);
+       }
+if (!index && !csv) acc_show("range", &tl.acc);
+return(0);
+}
+
+int main(int argc, char **argv)
+{
+const char *dev = "/dev/ttyUSB0", *file = NULL;
+long baud = 115200, window_s = 60;
+int status_s = 10, csv = 0, index = 0, q = 0, a;
+int64_t t0 = 0, t1 = 0;
+struct stat sb;
+
+for (a = 1; a < argc; a++)
+       {      const char *v = (a + 1 < argc) ? argv[a + 1] : "0";
+              if      (!strcmp(argv[a], "-d"))   dev = v, a++;
+              else if (!strcmp(argv[a], "-b"))   baud = atol(v), a++;
+              else if (!strcmp(argv[a], "-w"))   window_s = atol(v), a++;
+              else if (!strcmp(argv[a], "-s"))   status_s = atoi(v), a++;
+              else if (!strcmp(argv[a], "-D"))   tl.daemon = 1;
+              else if (!strcmp(argv[a], "-csv")) csv = 1;
+              else if (!strcmp(argv[a], "-i"))   index = 1;
+              else if (!strcmp(argv[a], "-q") && a + 2 < argc)
+                     {      t0 = strtoll(argv[a + 1], NULL, 0);
+                            t1 = strtoll(argv[a + 2], NULL, 0);
+                            q = 1;
+                            a += 2;
+                     }
+              else if (argv[a][0] != '-' && !file) file = argv[a];
+              else   {      fprintf(stderr, "telemd: unknown option %s\n", argv[a]);
+                            return(2);
+                     }
+       }
+if (!file)
+       {      fprintf(stderr, "telemd: no data file\n");
+              return(2);
+       }
+if (tl.daemon && !strcmp(dev, "-"))
+       {      fprintf(stderr, "telemd: -D can not read stdin (-d -)\n");
+              return(2);
+       }
+if (window_s < 1) window_s = 1;
+if (status_s < 1) status_s = 1;
+
+if (q || index)
+       {      tl.fd = open(file, O_RDONLY);
+              if (tl.fd < 0 || fstat(tl.fd, &sb)) { perror(file); return(1); }
+              if (!header_ok(file)) return(1);
+              tl.chunks = sb.st_size > PAGE ? (sb.st_size - PAGE) / chunk_bytes() : 0;
+              return(query(t0, t1, csv, index));
+       }
+
+tl.window_ms = window_s * 1000LL;
+tl.ring_n = window_s * RECORD_HZ + 1;
+tl.ring = calloc(tl.ring_n, sizeof(*tl.ring));
+if (!tl.ring || file_open(file)) return(1);
+if (tl.daemon)
+       {      if (daemon(1, 0)) { perror("daemon"); return(1); }
+              openlog("telemd", LOG_PID, LOG_DAEMON);
+       }
+return(record(dev, baud, status_s));
+}